@@ -0,0 +1,56 @@
+import struct
+
+from cutekit import args, builder, cmds, shell
+
+# Must match heap_event and enum heap_op in src/p5k-base/heap.h
+HEAP_EVENT = struct.Struct("<QQQII")
+
+HEAP_OPS = [
+    "alloc",
+    "free",
+    "realloc",
+    "major-create",
+    "major-free",
+    "major-grow",
+    "split",
+    "merge",
+    "slab-create",
+    "slab-destroy",
+    "slab-full",
+    "depot-drain",
+]
+
+
+def heapTraceCmd(args: args.Args) -> None:
+    path = args.consumeArg()
+    if path is None:
+        raise RuntimeError("usage: heap-trace <dump>")
+
+    with open(path, "rb") as f:
+        data = f.read()
+
+    counts = {}
+    for off in range(0, len(data) - HEAP_EVENT.size + 1, HEAP_EVENT.size):
+        time, ptr, major, size, op = HEAP_EVENT.unpack_from(data, off)
+        name = HEAP_OPS[op] if op < len(HEAP_OPS) else f"op{op}"
+        counts[name] = counts.get(name, 0) + 1
+        print(f"{time:>16} {name:<13} size={size:<8} ptr={ptr:#x} major={major:#x}")
+
+    print()
+    for name, count in sorted(counts.items(), key=lambda kv: -kv[1]):
+        print(f"{name:<13} {count}")
+
+
+cmds.append(cmds.Cmd("T", "heap-trace", "Decode a heap trace dump", heapTraceCmd))
+
+
+def heapBenchCmd(args: args.Args) -> None:
+    argv = []
+    while (arg := args.consumeArg()) is not None:
+        argv.append(arg)
+
+    bench = builder.build("p5k-bench", "host-x86_64")
+    shell.exec(bench.outfile(), *argv)
+
+
+cmds.append(cmds.Cmd("H", "heap-bench", "Run the host heap benchmarks", heapBenchCmd))
@@ -4,6 +4,8 @@
 
 #define FDT_MAGIC 0xd00dfeed
 
+#define FDT_ALIGN(x) (((x) + 3) & ~3)
+
 typedef struct {
   enum {
     FDT_BEGIN_NODE = 1,
@@ -12,6 +14,10 @@ typedef struct {
     FDT_NOP = 4,
     FDT_END = 9,
   } type;
+
+  /* Node name for FDT_BEGIN_NODE, property name and value for FDT_PROP. */
+  str name;
+  bytes value;
 } fdt_tok;
 
 typedef struct {
@@ -27,10 +33,19 @@ typedef struct {
   u32 size_dt_struct;
 } fdt_header;
 
+typedef struct {
+  u64 addr;
+  u64 size;
+} fdt_range;
+
 struct fdt {
+  fdt_header hdr;
+  bytes blob;
   cursor cur;
 };
 
+typedef res (*fdt_visit)(void *ctx, usize depth, fdt_tok tok ref);
+
 struct fdt_node {};
 
 /* --- Parser --------------------------------------------------------------- */
@@ -50,4 +65,146 @@ res fdt_parse_header(cursor c ref, fdt_header h ref) {
   return ok();
 }
 
+res fdt_open(void const *blob, struct fdt f ref) {
+  var c = cursor_make((bytes){sizeof(fdt_header), (u8 *)blob});
+  try(fdt_parse_header(&c, &f->hdr));
+
+  if (f->hdr.magic != FDT_MAGIC)
+    return err(RES_INVALID);
+
+  f->blob = (bytes){f->hdr.totalsize, (u8 *)blob};
+  f->cur = cursor_make(f->blob);
+  return ok();
+}
+
+res fdt_next(struct fdt f ref, fdt_tok tok ref) {
+  u32 type, len, nameoff;
+
+  do {
+    try(cursor_u32be(&f->cur, &type));
+  } while (type == FDT_NOP);
+
+  tok->type = type;
+  tok->name = (str){0, nil};
+  tok->value = (bytes){0, nil};
+
+  switch (type) {
+  case FDT_BEGIN_NODE:
+    len = cstr_nlen((cstr)f->cur.curr, cursor_rem(&f->cur));
+    tok->name = (str){len, f->cur.curr};
+    try(cursor_seek(&f->cur, FDT_ALIGN(len + 1), io_whence_curr(0)));
+    return ok();
+
+  case FDT_PROP: {
+    try(cursor_u32be(&f->cur, &len));
+    try(cursor_u32be(&f->cur, &nameoff));
+
+    if (f->hdr.off_dt_strings >= f->blob.len ||
+        nameoff >= f->blob.len - f->hdr.off_dt_strings ||
+        len > cursor_rem(&f->cur))
+      return err(RES_OUT_OF_BOUNDS);
+
+    let off = f->hdr.off_dt_strings + nameoff;
+    let name = f->blob.buf + off;
+    tok->name = (str){cstr_nlen((cstr)name, f->blob.len - off), name};
+    tok->value = (bytes){len, (u8 *)f->cur.curr};
+    try(cursor_seek(&f->cur, FDT_ALIGN(len), io_whence_curr(0)));
+    return ok();
+  }
+
+  case FDT_END_NODE:
+  case FDT_END:
+    return ok();
+
+  default:
+    return err(RES_INVALID);
+  }
+}
+
+/* Calls visit for every token of the structure block. Nodes are visited at
+ * the depth of their parent's properties, so the root node is at 0, its
+ * properties and children at 1, and so on. */
+res fdt_walk(struct fdt f ref, fdt_visit visit, void *ctx) {
+  usize depth = 0;
+  fdt_tok tok;
+
+  try(cursor_seek(&f->cur, f->hdr.off_dt_struct, io_whence_start(0)));
+
+  for (;;) {
+    try(fdt_next(f, &tok));
+
+    if (tok.type == FDT_END)
+      return ok();
+
+    if (tok.type == FDT_END_NODE) {
+      if (depth == 0)
+        return err(RES_INVALID);
+      depth--;
+    }
+
+    try(visit(ctx, depth, &tok));
 
+    if (tok.type == FDT_BEGIN_NODE)
+      depth++;
+  }
+}
+
+/* Reads the index-th entry of the memory reservation map. */
+res fdt_rsvmap(struct fdt f ref, usize index, fdt_range r ref) {
+  var c = f->cur;
+
+  try(cursor_seek(&c, f->hdr.off_mem_rsvmap + index * 16, io_whence_start(0)));
+  try(cursor_u64be(&c, &r->addr));
+  try(cursor_u64be(&c, &r->size));
+
+  if (r->addr == 0 && r->size == 0)
+    return err(RES_OUT_OF_BOUNDS);
+
+  return ok();
+}
+
+/* Reads a value spanning cells big-endian 32-bit cells. */
+res fdt_cells(cursor c ref, u32 cells, u64 *v) {
+  u32 cell;
+
+  *v = 0;
+  for (u32 i = 0; i < cells; i++) {
+    try(cursor_u32be(c, &cell));
+    *v = (*v << 32) | cell;
+  }
+
+  return ok();
+}
+
+/* Matches a node name against a base name, ignoring the unit address. */
+bool fdt_name_is(str name, cstr base) {
+  usize i = 0;
+
+  for (; i < name.len && base[i]; i++)
+    if (name.buf[i] != (u8)base[i])
+      return false;
+
+  return !base[i] && (i == name.len || name.buf[i] == '@');
+}
+
+bool fdt_prop_is(fdt_tok tok ref, cstr name) {
+  usize i = 0;
+
+  if (tok->type != FDT_PROP)
+    return false;
+
+  for (; i < tok->name.len && name[i]; i++)
+    if (tok->name.buf[i] != (u8)name[i])
+      return false;
+
+  return !name[i] && i == tok->name.len;
+}
+
+u32 fdt_prop_u32(fdt_tok tok ref) {
+  u32 v;
+  var c = cursor_make(tok->value);
+
+  if (cursor_u32be(&c, &v).uvalue != 4)
+    return 0;
+  return v;
+}
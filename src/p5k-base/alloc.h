@@ -2,16 +2,20 @@
 
 #include "base.h"
 
+/* The batch entries are optional, the helpers below fall back to one call
+ * of alloc per buffer. */
 typedef struct {
   void *ctx;
   void *(*alloc)(void *ctx, usize n, void *buf);
+  usize (*alloc_batch)(void *ctx, usize n, usize count, void **bufs);
+  void (*free_batch)(void *ctx, void **bufs, usize count);
 } alloc;
 
-inline void *alloc_alloc(alloc alloc, usize n) {
+static inline void *alloc_alloc(alloc alloc, usize n) {
   return alloc.alloc(alloc.ctx, n, nil);
 }
 
-inline void *alloc_allocz(alloc alloc, usize n) {
+static inline void *alloc_allocz(alloc alloc, usize n) {
   let buf = alloc.alloc(alloc.ctx, n, nil);
   if (buf == nil)
     return buf;
@@ -19,10 +23,34 @@ inline void *alloc_allocz(alloc alloc, usize n) {
   return buf;
 }
 
-inline void alloc_free(alloc alloc, void *buf) {
+static inline void alloc_free(alloc alloc, void *buf) {
   alloc.alloc(alloc.ctx, 0, buf);
 }
 
-inline void *alloc_realloc(alloc alloc, usize n, void *buf) {
+static inline void *alloc_realloc(alloc alloc, usize n, void *buf) {
   return alloc.alloc(alloc.ctx, n, buf);
 }
+
+static inline usize alloc_alloc_batch(alloc alloc, usize n, usize count,
+                                      void **bufs) {
+  if (alloc.alloc_batch)
+    return alloc.alloc_batch(alloc.ctx, n, count, bufs);
+
+  for (usize i = 0; i < count; i++) {
+    bufs[i] = alloc.alloc(alloc.ctx, n, nil);
+    if (bufs[i] == nil)
+      return i;
+  }
+  return count;
+}
+
+static inline void alloc_free_batch(alloc alloc, void **bufs, usize count) {
+  if (alloc.free_batch) {
+    alloc.free_batch(alloc.ctx, bufs, count);
+    return;
+  }
+
+  for (usize i = 0; i < count; i++)
+    if (bufs[i] != nil)
+      alloc.alloc(alloc.ctx, 0, bufs[i]);
+}
@@ -39,6 +39,7 @@ typedef struct {
   enum res_type {
     RES_OK,
     RES_OUT_OF_BOUNDS,
+    RES_INVALID,
   } type;
 
   union {
@@ -47,10 +48,10 @@ typedef struct {
   };
 } res;
 
-res ok() { return (res){RES_OK, .uvalue = 0}; }
-res iok(isize v) { return (res){RES_OK, .ivalue = v}; }
-res uok(usize v) { return (res){RES_OK, .uvalue = v}; }
-res err(enum res_type t) { return (res){t, .uvalue = 0}; }
+static inline res ok() { return (res){RES_OK, .uvalue = 0}; }
+static inline res iok(isize v) { return (res){RES_OK, .ivalue = v}; }
+static inline res uok(usize v) { return (res){RES_OK, .uvalue = v}; }
+static inline res err(enum res_type t) { return (res){t, .uvalue = 0}; }
 
 #define try(expr)                                                              \
   ({                                                                           \
@@ -68,16 +69,41 @@ typedef struct {
 
 typedef char const *cstr;
 
+static inline usize cstr_len(cstr s) {
+  usize len = 0;
+  while (s[len])
+    len++;
+  return len;
+}
+
+/* Same for strings in untrusted buffers, never reads past max bytes. */
+static inline usize cstr_nlen(cstr s, usize max) {
+  usize len = 0;
+  while (len < max && s[len])
+    len++;
+  return len;
+}
+
 #define _s(s) ((str){sizeof(s) - 1, (u8 const *)(s)})
 
-bytes mem_zero(bytes buf) {
+static inline bytes mem_zero(bytes buf) {
   for (usize i = 0; i < buf.len; i++)
     buf.buf[i] = 0;
   return buf;
 }
 
-bytes mem_copy(bytes dst, bytes src) {
-  for (usize i = 0; i < dst.len && i < src.len; i++)
+typedef usize __attribute__((may_alias)) _mem_word;
+
+static inline bytes mem_copy(bytes dst, bytes src) {
+  usize len = dst.len < src.len ? dst.len : src.len;
+  usize i = 0;
+
+  if ((((uintptr_t)dst.buf | (uintptr_t)src.buf) & (sizeof(usize) - 1)) == 0) {
+    for (; i + sizeof(usize) <= len; i += sizeof(usize))
+      *(_mem_word *)(dst.buf + i) = *(_mem_word *)(src.buf + i);
+  }
+
+  for (; i < len; i++)
     dst.buf[i] = src.buf[i];
   return dst;
 }
\ No newline at end of file
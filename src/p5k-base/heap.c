@@ -3,27 +3,89 @@
 /* Heap hook functions */
 
 void *heap_alloc_block(heap *heap, usize size) {
-  return heap->alloc(heap->ctx, size);
+  void *ptr = heap->alloc(heap->ctx, size);
+  if (ptr)
+    heap->stats.reserved += size;
+  return ptr;
 }
 
 void heap_free_block(heap *heap, void *ptr, usize size) {
+  heap->stats.reserved -= size;
   heap->free(heap->ctx, ptr, size);
 }
 
-void heap_trace(heap *heap, cstr msg, ...) {
+bool heap_grow_block(heap *heap, void *ptr, usize size, usize new_size) {
+  if (!heap->grow || !heap->grow(heap->ctx, ptr, size, new_size))
+    return false;
+  heap->stats.reserved += new_size - size;
+  return true;
+}
+
+void heap_error(heap *heap, cstr msg, ...) {
   va_list args;
   va_start(args, msg);
-  heap->log(heap->ctx, HEAP_TRACE, msg, args);
+  heap->log(heap->ctx, HEAP_ERROR, msg, args);
   va_end(args);
 }
 
-void heap_error(heap *heap, cstr msg, ...) {
+void heap_info(heap *heap, cstr msg, ...) {
   va_list args;
   va_start(args, msg);
-  heap->log(heap->ctx, HEAP_ERROR, msg, args);
+  heap->log(heap->ctx, HEAP_INFO, msg, args);
   va_end(args);
 }
 
+/* Heap trace functions */
+
+#ifdef HEAP_TRACING
+
+void heap_trace_attach(heap *heap, heap_event *buf, usize len,
+                       u64 (*clock)(void *ctx)) {
+  heap->tracer = (heap_tracer){
+      .buf = buf,
+      .len = len,
+      .clock = clock,
+  };
+}
+
+void heap_trace_record(heap *heap, enum heap_op op, usize size, void *ptr,
+                       void *major) {
+  heap_tracer *tracer = &heap->tracer;
+  heap_event *event;
+
+  if (!tracer->len)
+    return;
+
+  event = &tracer->buf[tracer->head % tracer->len];
+  *event = (heap_event){
+      .time = tracer->clock ? tracer->clock(heap->ctx) : tracer->head,
+      .ptr = (uintptr_t)ptr,
+      .major = (uintptr_t)major,
+      .size = size,
+      .op = op,
+  };
+
+  tracer->head++;
+  if (tracer->head - tracer->tail > tracer->len) {
+    tracer->lost += tracer->head - tracer->tail - tracer->len;
+    tracer->tail = tracer->head - tracer->len;
+  }
+}
+
+usize heap_trace_read(heap *heap, heap_event *buf, usize len) {
+  heap_tracer *tracer = &heap->tracer;
+  usize n = 0;
+
+  while (n < len && tracer->tail != tracer->head) {
+    buf[n++] = tracer->buf[tracer->tail % tracer->len];
+    tracer->tail++;
+  }
+
+  return n;
+}
+
+#endif
+
 /* Heap node functions */
 
 bool heap_node_check(heap *heap, heap_node *node) {
@@ -81,59 +143,248 @@ void heap_node_remove(heap_node *node) {
   node->next = NULL;
 }
 
+/* Heap index functions */
+
+static usize heap_msb(usize x) {
+  return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(x);
+}
+
+void heap_index_mapping(usize size, usize *fl, usize *sl) {
+  *fl = heap_msb(size);
+  *sl = (size >> (*fl - HEAP_INDEX_SL_BITS)) & (HEAP_INDEX_SL - 1);
+
+  if (*fl >= HEAP_INDEX_FL) {
+    *fl = HEAP_INDEX_FL - 1;
+    *sl = HEAP_INDEX_SL - 1;
+  }
+}
+
+void heap_index_insert(heap *heap, heap_minor *min) {
+  heap_index *index = &heap->index;
+  usize fl, sl;
+
+  heap_index_mapping(min->size, &fl, &sl);
+  heap->stats.free += min->size;
+
+  min->prev_free = NULL;
+  min->next_free = index->free[fl][sl];
+  if (min->next_free)
+    min->next_free->prev_free = min;
+
+  index->free[fl][sl] = min;
+  index->fl |= 1u << fl;
+  index->sl[fl] |= 1u << sl;
+}
+
+void heap_index_remove(heap *heap, heap_minor *min) {
+  heap_index *index = &heap->index;
+  usize fl, sl;
+
+  heap_index_mapping(min->size, &fl, &sl);
+  heap->stats.free -= min->size;
+
+  if (min->prev_free)
+    min->prev_free->next_free = min->next_free;
+  else
+    index->free[fl][sl] = min->next_free;
+
+  if (min->next_free)
+    min->next_free->prev_free = min->prev_free;
+
+  min->prev_free = NULL;
+  min->next_free = NULL;
+
+  if (!index->free[fl][sl]) {
+    index->sl[fl] &= ~(1u << sl);
+    if (!index->sl[fl])
+      index->fl &= ~(1u << fl);
+  }
+}
+
+heap_minor *heap_index_find(heap *heap, usize size) {
+  heap_index *index = &heap->index;
+  usize fl, sl;
+  u32 map;
+
+  /* Round up to the next list boundary so any minor found is big enough */
+  size += (1ul << (heap_msb(size) - HEAP_INDEX_SL_BITS)) - 1;
+  if (heap_msb(size) >= HEAP_INDEX_FL)
+    return NULL;
+
+  heap_index_mapping(size, &fl, &sl);
+
+  map = index->sl[fl] & (~0u << sl);
+  if (!map) {
+    if (fl + 1 >= HEAP_INDEX_FL)
+      return NULL;
+
+    map = index->fl & (~0u << (fl + 1));
+    if (!map)
+      return NULL;
+
+    fl = __builtin_ctz(map);
+    map = index->sl[fl];
+  }
+
+  sl = __builtin_ctz(map);
+  return index->free[fl][sl];
+}
+
 /* Heap major functions */
 
 usize heap_major_avail(heap_major *maj) { return maj->size - maj->used; }
 
 heap_major *heap_major_create(heap *heap, usize size) {
-  size = size + HEAP_ALIGN;
+  heap_major *maj;
+  heap_minor *min;
+
+  /* Room for both the major header and the first minor header */
+  size = size + HEAP_ALIGN * 2;
   size = size < HEAP_MIN_REQU ? HEAP_MIN_REQU : size;
   size = HEAP_PAGE_ALIGNED(size);
 
-  heap_trace(heap, "heap major create (size=%zu)", size);
+  maj = heap_major_reuse(heap, size);
+  if (maj) {
+    size = maj->size;
+  } else {
+    maj = (heap_major *)heap_alloc_block(heap, size);
+    if (!maj && heap->spare) {
+      /* Give the retained majors back and try again */
+      heap_spare_trim(heap, 0, 0);
+      maj = (heap_major *)heap_alloc_block(heap, size);
+    }
+
+    if (!maj)
+      return NULL;
+
+    heap_trace(heap, HEAP_OP_MAJOR_CREATE, size, maj, maj);
+  }
 
-  heap_major *maj = (heap_major *)heap_alloc_block(heap, size);
   *maj = (heap_major){
       .magic = HEAP_MAGIC,
       .size = size,
       .used = HEAP_ALIGN,
   };
 
-  return maj;
-}
+  if (heap->root)
+    heap_node_prepend(&heap->root->base, &maj->base);
+  heap->root = maj;
+  heap->stats.majors++;
+  heap->stats.minors++;
 
-heap_minor *heap_major_alloc(heap *heap, heap_major *maj, usize size) {
-  heap_minor *min = maj->minor;
+  min = heap_minor_create(maj, 0);
+  heap_index_insert(heap, min);
 
-  while (min) {
-    if (!min->used && heap_minor_avail(min) >= size) {
-      heap_trace(heap, "heap minor is unused and big enough, reusing");
-      heap_minor_resize(min, size);
-      return min;
-    }
+  return maj;
+}
 
-    if (min->used && heap_minor_avail(min) >= size + HEAP_ALIGN) {
-      heap_trace(heap, "heap minor is used but big enough, splitting");
-      return heap_minor_split(min, size);
-    }
+bool heap_major_grow(heap *heap, heap_major *maj, usize size) {
+  usize new_size = HEAP_PAGE_ALIGNED(maj->size + size);
 
-    min = min->next;
-  }
+  if (!heap_grow_block(heap, maj, maj->size, new_size))
+    return false;
 
-  return NULL;
+  heap_trace(heap, HEAP_OP_MAJOR_GROW, new_size, maj, maj);
+  maj->size = new_size;
+  return true;
 }
 
 void heap_major_free(heap *heap, heap_major *maj) {
   heap_major *next = maj->next;
 
+  heap_trace(heap, HEAP_OP_MAJOR_FREE, maj->size, maj, maj);
   heap_node_remove(&maj->base);
+  maj->magic = HEAP_DEAD;
   heap_free_block(heap, maj, maj->size);
 
   if (heap->root == maj)
     heap->root = next;
 
-  if (heap->best == maj)
-    heap->best = NULL;
+  if (heap->spare == maj)
+    heap->spare = next;
+}
+
+void heap_major_retain(heap *heap, heap_major *maj) {
+  heap_major *next = maj->next;
+
+  heap->stats.majors--;
+  heap->stats.minors--;
+
+  /* Batch frees may still look at headers in this major, releasing is left
+   * to the end of the batch. */
+  if (!heap->batch && maj->size > heap_retain_bytes(heap)) {
+    heap_major_free(heap, maj);
+    return;
+  }
+
+  heap_node_remove(&maj->base);
+  if (heap->root == maj)
+    heap->root = next;
+
+  if (heap->spare)
+    heap_node_prepend(&heap->spare->base, &maj->base);
+  heap->spare = maj;
+  heap->spare_count++;
+  heap->spare_bytes += maj->size;
+
+  if (!heap->batch)
+    heap_spare_settle(heap);
+}
+
+heap_major *heap_major_reuse(heap *heap, usize size) {
+  heap_major *maj = heap->spare;
+
+  while (maj && maj->size < size)
+    maj = maj->next;
+
+  if (!maj)
+    return NULL;
+
+  if (heap->spare == maj)
+    heap->spare = maj->next;
+
+  heap_node_remove(&maj->base);
+  heap->spare_count--;
+  heap->spare_bytes -= maj->size;
+
+  return maj;
+}
+
+/* Heap spare functions */
+
+usize heap_retain_majors(heap *heap) {
+  return heap->retain_majors ? heap->retain_majors : HEAP_RETAIN_MAJORS;
+}
+
+usize heap_retain_bytes(heap *heap) {
+  return heap->retain_bytes ? heap->retain_bytes : HEAP_RETAIN_BYTES;
+}
+
+void heap_spare_settle(heap *heap) {
+  /* Trim down to half the limits so a burst hovering around the limit
+   * doesn't release and recreate a major on every free. */
+  if (heap->spare_count > heap_retain_majors(heap) ||
+      heap->spare_bytes > heap_retain_bytes(heap)) {
+    heap_spare_trim(heap, heap_retain_majors(heap) / 2,
+                    heap_retain_bytes(heap) / 2);
+  }
+}
+
+void heap_spare_trim(heap *heap, usize majors, usize bytes) {
+  heap_major *maj = heap->spare;
+  heap_major *prev;
+
+  while (maj && maj->next)
+    maj = maj->next;
+
+  /* Oldest spares are at the tail */
+  while (maj && (heap->spare_count > majors || heap->spare_bytes > bytes)) {
+    prev = maj->prev;
+    heap->spare_count--;
+    heap->spare_bytes -= maj->size;
+    heap_major_free(heap, maj);
+    maj = prev;
+  }
 }
 
 /* Heap minor functions */
@@ -156,7 +407,7 @@ heap_minor *heap_minor_create(heap_major *maj, usize size) {
   return min;
 }
 
-heap_minor *heap_minor_split(heap_minor *min, usize size) {
+heap_minor *heap_minor_split(heap *heap, heap_minor *min, usize size) {
   heap_major *maj = min->major;
   heap_minor *newMin = (heap_minor *)((uintptr_t)min + HEAP_ALIGN + min->used);
 
@@ -170,41 +421,138 @@ heap_minor *heap_minor_split(heap_minor *min, usize size) {
   min->size = min->used;
   maj->used += HEAP_ALIGN + size;
   heap_node_append(&min->base, &newMin->base);
+  heap->stats.minors++;
+
+  if (!newMin->used)
+    heap_index_insert(heap, newMin);
 
   return newMin;
 }
 
+void heap_minor_alloc(heap *heap, heap_minor *min, usize size) {
+  heap->stats.in_use += size;
+  heap_index_remove(heap, min);
+  heap_minor_resize(min, size);
+  heap_minor_trim(heap, min);
+}
+
+heap_minor *heap_minor_get(heap *heap, usize size) {
+  heap_major *maj;
+  heap_minor *min;
+
+  min = heap_index_find(heap, size);
+  if (!min) {
+    heap->stats.slow_majors++;
+    maj = heap_major_create(heap, size);
+    if (!maj)
+      return NULL;
+    min = maj->minor;
+  }
+
+  heap_minor_alloc(heap, min, size);
+  return min;
+}
+
+void heap_minor_trim(heap *heap, heap_minor *min) {
+  heap_minor *next = min->next;
+  heap_minor *moved;
+  heap_minor tmp;
+  usize slack = heap_minor_avail(min);
+
+  if (!slack)
+    return;
+
+  if (next && !next->used) {
+    /* Slide the unused successor down so it picks up the slack, the headers
+     * may overlap so go through a copy. */
+    heap_index_remove(heap, next);
+    tmp = *next;
+    moved = (heap_minor *)((uintptr_t)next - slack);
+    *moved = tmp;
+    moved->size += slack;
+    moved->prev = min;
+    if (moved->next)
+      moved->next->prev = moved;
+
+    min->next = moved;
+    min->size = min->used;
+    heap_index_insert(heap, moved);
+    return;
+  }
+
+  if (slack >= HEAP_ALIGN * 2) {
+    heap_trace(heap, HEAP_OP_SPLIT, slack, heap_minor_to(min), min->major);
+    heap_minor_split(heap, min, 0);
+  }
+}
+
+void heap_minor_merge(heap *heap, heap_minor *min) {
+  heap_minor *next = min->next;
+
+  heap_trace(heap, HEAP_OP_MERGE, next->size, heap_minor_to(next), min->major);
+  heap_index_remove(heap, next);
+  next->magic = HEAP_DEAD;
+  min->size += next->size + HEAP_ALIGN;
+  min->major->used -= HEAP_ALIGN;
+  heap->stats.minors--;
+
+  heap_node_remove(&next->base);
+}
+
+bool heap_minor_grow(heap *heap, heap_minor *min, usize size) {
+  heap_minor *next = min->next;
+
+  if (next && !next->used && min->size + HEAP_ALIGN + next->size >= size) {
+    heap_minor_merge(heap, min);
+    return true;
+  }
+
+  /* Only the last minor can take over space added at the end of the major */
+  if (next && (next->used || next->next))
+    return false;
+
+  if (!heap_major_grow(heap, min->major,
+                       size - min->size - (next ? next->size + HEAP_ALIGN : 0)))
+    return false;
+
+  if (next)
+    heap_minor_merge(heap, min);
+
+  min->size = (uintptr_t)min->major + min->major->size -
+              (uintptr_t)heap_minor_to(min);
+  return true;
+}
+
 void heap_minor_free(heap *heap, heap_minor *min) {
   heap_major *maj = min->major;
   heap_minor *prev = min->prev;
   heap_minor *next = min->next;
 
+  heap->stats.in_use -= min->used;
   maj->used -= min->used;
   min->used = 0;
 
-  if (prev) {
-    heap_trace(heap, "mergin with previous minor");
+  if (prev && !prev->used) {
+    heap_trace(heap, HEAP_OP_MERGE, min->size, heap_minor_to(prev), maj);
+    heap_index_remove(heap, prev);
     min->magic = HEAP_DEAD;
     prev->size += min->size + HEAP_ALIGN;
     maj->used -= HEAP_ALIGN;
+    heap->stats.minors--;
 
     heap_node_remove(&min->base);
     min = prev;
   }
 
-  if (next && !next->used) {
-    heap_trace(heap, "next minor is unused, merging");
-    next->magic = HEAP_DEAD;
-    min->size += next->size + HEAP_ALIGN;
-    maj->used -= HEAP_ALIGN;
+  if (next && !next->used)
+    heap_minor_merge(heap, min);
 
-    heap_node_remove(&next->base);
+  if (!min->prev && !min->next) {
+    heap_major_retain(heap, maj);
+    return;
   }
 
-  if (maj->used == HEAP_ALIGN) {
-    heap_trace(heap, "major is empty, freeing");
-    heap_major_free(heap, maj);
-  }
+  heap_index_insert(heap, min);
 }
 
 void heap_minor_resize(heap_minor *min, usize size) {
@@ -224,127 +572,1062 @@ void *heap_minor_to(heap_minor *min) {
   return (void *)((uintptr_t)min + HEAP_ALIGN);
 }
 
-/* Heap functions */
+/* Heap slab functions */
 
-void *heap_alloc(heap *heap, usize size) {
-  heap_major *maj;
-  heap_major *prev;
-  heap_minor *min;
+/* Free slab objects hold the free list link in their first word and
+ * HEAP_SLAB_FREE in their second, every class has room for both. A live
+ * object may hold the same value by chance, so a match is only a double
+ * free once the object is found on the free list. */
+#define HEAP_SLAB_POISON(ptr) (((uintptr_t *)(ptr))[1])
 
-  heap_trace(heap, "------------------------");
-  heap_trace(heap, "allocating %zu bytes", size);
+bool heap_slab_is_free(heap_slab *slab, void *ptr) {
+  if (HEAP_SLAB_POISON(ptr) != (uintptr_t)HEAP_SLAB_FREE)
+    return false;
 
-  size = HEAP_ALIGNED(size);
-  if (size == 0) {
-    heap_trace(heap, "done: size is 0");
+  for (void *obj = slab->free; obj; obj = *(void **)obj)
+    if (obj == ptr)
+      return true;
+
+  return false;
+}
+
+static usize const heap_slab_sizes[HEAP_SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256,
+};
+
+usize heap_slab_class(usize size) {
+  if (size <= 64)
+    return (size - 1) / 16;
+  if (size <= 96)
+    return 4;
+  if (size <= 128)
+    return 5;
+  if (size <= 192)
+    return 6;
+  return 7;
+}
+
+usize heap_slab_class_size(usize class) { return heap_slab_sizes[class]; }
+
+heap_slab *heap_slab_create(heap *heap, usize class) {
+  usize size = heap_slab_class_size(class);
+  uintptr_t obj, end;
+
+  heap_slab *slab = (heap_slab *)heap_alloc_block(heap, HEAP_SLAB_SIZE);
+  if (!slab)
     return NULL;
+
+  heap_trace(heap, HEAP_OP_SLAB_CREATE, size, slab, slab);
+  heap->stats.slabs++;
+  heap->stats.slow_slabs++;
+
+  *slab = (heap_slab){
+      .magic = HEAP_SLAB_MAGIC,
+      .heap = heap,
+      .class = class,
+  };
+
+  obj = (uintptr_t)slab + HEAP_ALIGN;
+  end = (uintptr_t)slab + HEAP_SLAB_SIZE;
+  while (obj + size <= end) {
+    *(void **)obj = slab->free;
+    HEAP_SLAB_POISON(obj) = (uintptr_t)HEAP_SLAB_FREE;
+    slab->free = (void *)obj;
+    obj += size;
   }
 
-  if (!heap->root) {
-    heap_trace(heap, "no root, creating new major");
-    heap->root = heap_major_create(heap, size);
-    heap->best = heap->root;
-    min = heap_minor_create(heap->root, size);
+  return slab;
+}
+
+void heap_slab_destroy(heap *heap, heap_slab *slab) {
+  heap_trace(heap, HEAP_OP_SLAB_DESTROY, heap_slab_class_size(slab->class),
+             slab, slab);
 
-    heap_trace(heap, "done: created new major");
-    return heap_minor_to(min);
+  if (heap->slabs[slab->class] == slab)
+    heap->slabs[slab->class] = slab->next;
+
+  heap_node_remove(&slab->base);
+  slab->magic = HEAP_DEAD;
+  heap->stats.slabs--;
+  heap_free_block(heap, slab, HEAP_SLAB_SIZE);
+}
+
+void *heap_slab_alloc(heap *heap, usize size) {
+  usize class = heap_slab_class(size);
+  heap_slab *slab = heap->slabs[class];
+  void *ptr;
+
+  if (!slab) {
+    slab = heap_slab_create(heap, class);
+    if (!slab)
+      return NULL;
+    heap->slabs[class] = slab;
   }
 
-  if (!heap->best) {
-    heap_trace(heap, "no best, setting to root");
-    heap->best = heap->root;
+  ptr = slab->free;
+  slab->free = *(void **)ptr;
+  HEAP_SLAB_POISON(ptr) = 0;
+  slab->used++;
+  heap->stats.in_use += heap_slab_class_size(class);
+
+  if (!slab->free) {
+    heap_trace(heap, HEAP_OP_SLAB_FULL, heap_slab_class_size(class), slab,
+               slab);
+    heap->slabs[class] = slab->next;
+    heap_node_remove(&slab->base);
   }
 
-  if (heap_major_avail(heap->best) >= size) {
-    heap_trace(heap, "best major has enough space");
-    min = heap_major_alloc(heap, heap->best, size);
-    if (min) {
-      heap_trace(heap, "done: allocated from best major");
-      return heap_minor_to(min);
+  return ptr;
+}
+
+void heap_slab_free(heap *heap, heap_slab *slab, void *ptr) {
+  heap_slab *head = heap->slabs[slab->class];
+
+  if (heap_slab_is_free(slab, ptr)) {
+    heap_error(heap, "heap double free detected");
+    return;
+  }
+
+  if (!slab->free) {
+    if (head)
+      heap_node_prepend(&head->base, &slab->base);
+    heap->slabs[slab->class] = slab;
+  }
+
+  *(void **)ptr = slab->free;
+  HEAP_SLAB_POISON(ptr) = (uintptr_t)HEAP_SLAB_FREE;
+  slab->free = ptr;
+  slab->used--;
+  heap->stats.in_use -= heap_slab_class_size(slab->class);
+
+  /* Keep the last slab of a class around so alloc/free loops on a single
+   * object don't bounce pages through the backing allocator. */
+  if (!heap->batch && !slab->used && (slab->prev || slab->next))
+    heap_slab_destroy(heap, slab);
+}
+
+heap_slab *heap_slab_from(heap *heap, void *ptr) {
+  heap_slab *slab = (heap_slab *)((uintptr_t)ptr & ~(HEAP_SLAB_SIZE - 1));
+
+  if (slab->magic != HEAP_SLAB_MAGIC || slab->heap != heap)
+    return NULL;
+
+  return slab;
+}
+
+/* Heap large functions */
+
+usize heap_large_threshold(heap *heap) {
+  return heap->large_threshold ? heap->large_threshold : HEAP_LARGE_DEFAULT;
+}
+
+void *heap_large_alloc(heap *heap, usize size) {
+  usize block = HEAP_PAGE_ALIGNED(size + HEAP_ALIGN);
+  heap_large *large = (heap_large *)heap_alloc_block(heap, block);
+
+  if (!large)
+    return NULL;
+
+  *large = (heap_large){
+      .magic = HEAP_LARGE_MAGIC,
+      .size = block,
+      .used = size,
+  };
+
+  if (heap->large)
+    heap_node_prepend(&heap->large->base, &large->base);
+  heap->large = large;
+  heap->stats.large++;
+  heap->stats.in_use += size;
+
+  return (void *)((uintptr_t)large + HEAP_ALIGN);
+}
+
+bool heap_large_resize(heap *heap, heap_large *large, usize size) {
+  usize block = HEAP_PAGE_ALIGNED(size + HEAP_ALIGN);
+
+  if (block > large->size) {
+    if (!heap_grow_block(heap, large, large->size, block))
+      return false;
+    large->size = block;
+  }
+
+  heap->stats.in_use += size - large->used;
+  large->used = size;
+  return true;
+}
+
+void heap_large_free(heap *heap, heap_large *large) {
+  if (heap->large == large)
+    heap->large = large->next;
+
+  heap_node_remove(&large->base);
+  large->magic = HEAP_DEAD;
+  heap->stats.large--;
+  heap->stats.in_use -= large->used;
+  heap_free_block(heap, large, large->size);
+}
+
+heap_large *heap_large_from(void *ptr) {
+  return (heap_large *)((uintptr_t)ptr - HEAP_ALIGN);
+}
+
+/* Heap profiler functions */
+
+bool heap_prof_sample(heap *heap, usize size) {
+  heap->prof.countdown -= size;
+  if (heap->prof.countdown > 0)
+    return false;
+
+  heap->prof.countdown += heap->prof.rate;
+  if (heap->prof.countdown <= 0)
+    heap->prof.countdown = heap->prof.rate;
+  return true;
+}
+
+heap_prof_site *heap_prof_lookup(heap *heap, void *site) {
+  usize hash = ((uintptr_t)site >> 2) * 2654435761u;
+  heap_prof_site *slot;
+
+  for (usize i = 0; i < HEAP_PROF_SITES; i++) {
+    slot = &heap->prof.sites[(hash + i) % HEAP_PROF_SITES];
+    if (slot->site == site)
+      return slot;
+    if (!slot->site) {
+      slot->site = site;
+      return slot;
     }
-    heap_trace(heap, "major doesn't enough contiguous space");
   }
 
-  maj = heap->root;
-  heap_trace(heap, "searching for major with enough space");
-  while (maj) {
-    if (heap_major_avail(maj) > heap_major_avail(heap->best)) {
-      heap_trace(heap, "found better major");
-      heap->best = maj;
+  return NULL;
+}
+
+void *heap_prof_alloc(heap *heap, usize size, void *site) {
+  heap_prof_site *slot = heap_prof_lookup(heap, site);
+  usize weight = size < heap->prof.rate ? heap->prof.rate : size;
+  heap_large *large;
+  heap_minor *min;
+  void *ptr;
+
+  size = HEAP_ALIGNED(size);
+
+  if (size > heap_large_threshold(heap)) {
+    ptr = heap_large_alloc(heap, size);
+    if (!ptr)
+      return NULL;
+    large = heap_large_from(ptr);
+    large->site = slot ? site : NULL;
+    large->weight = weight;
+  } else {
+    min = heap_minor_get(heap, size);
+    if (!min)
+      return NULL;
+    ptr = heap_minor_to(min);
+    min->site = slot ? site : NULL;
+    min->weight = weight;
+  }
+
+  heap_trace(heap, HEAP_OP_ALLOC, size, ptr, NULL);
+
+  if (slot) {
+    slot->live_bytes += weight;
+    slot->live_samples++;
+    slot->total_samples++;
+  }
+
+  return ptr;
+}
+
+void heap_prof_release(heap *heap, void *site, usize weight) {
+  heap_prof_site *slot = heap_prof_lookup(heap, site);
+
+  if (!slot)
+    return;
+
+  slot->live_bytes -= weight;
+  slot->live_samples--;
+}
+
+/* Heap lock functions */
+
+void heap_lock(heap *heap) {
+  while (atomic_flag_test_and_set_explicit(&heap->lock, memory_order_acquire))
+    ;
+}
+
+void heap_unlock(heap *heap) {
+  atomic_flag_clear_explicit(&heap->lock, memory_order_release);
+}
+
+/* Heap depot functions */
+
+heap_magazine *heap_depot_get(heap *heap, usize class, bool full) {
+  heap_magazine **list =
+      full ? &heap->depot.full[class] : &heap->depot.empty[class];
+  heap_magazine *mag = *list;
+
+  if (mag) {
+    *list = mag->next;
+    if (full)
+      heap->depot.nfull[class]--;
+    return mag;
+  }
+
+  if (full)
+    return NULL;
+
+  mag = heap_alloc(heap, sizeof(heap_magazine));
+  if (mag)
+    mag->count = 0;
+  return mag;
+}
+
+void heap_depot_put(heap *heap, usize class, heap_magazine *mag) {
+  if (!mag->count) {
+    mag->next = heap->depot.empty[class];
+    heap->depot.empty[class] = mag;
+    return;
+  }
+
+  if (heap->depot.nfull[class] >= HEAP_DEPOT_MAX) {
+    heap_trace(heap, HEAP_OP_DEPOT_DRAIN, mag->count, mag, NULL);
+    heap_magazine_drain(heap, mag);
+    heap_free(heap, mag);
+    return;
+  }
+
+  mag->next = heap->depot.full[class];
+  heap->depot.full[class] = mag;
+  heap->depot.nfull[class]++;
+}
+
+/* Objects parked in a magazine carry the slab poison like free slab objects
+ * do, it is cleared on the way out so a live object never holds it. */
+void *heap_magazine_pop(heap_magazine *mag) {
+  void *ptr = mag->objs[--mag->count];
+  HEAP_SLAB_POISON(ptr) = 0;
+  return ptr;
+}
+
+void heap_magazine_push(heap_magazine *mag, void *ptr) {
+  HEAP_SLAB_POISON(ptr) = (uintptr_t)HEAP_SLAB_FREE;
+  mag->objs[mag->count++] = ptr;
+}
+
+bool heap_magazine_holds(heap_magazine *mag, void *ptr) {
+  for (usize i = 0; mag && i < mag->count; i++)
+    if (mag->objs[i] == ptr)
+      return true;
+
+  return false;
+}
+
+void heap_magazine_drain(heap *heap, heap_magazine *mag) {
+  while (mag->count)
+    heap_free(heap, heap_magazine_pop(mag));
+}
+
+/* Returns every object parked in the depot to its slab and frees the
+ * magazines, so the slabs can go. Magazines still loaded in a cache stay
+ * there until the cache is flushed. */
+void heap_depot_drain(heap *heap) {
+  heap_magazine *mag;
+
+  for (usize class = 0; class < HEAP_SLAB_CLASSES; class++) {
+    while ((mag = heap->depot.full[class])) {
+      heap->depot.full[class] = mag->next;
+      heap_trace(heap, HEAP_OP_DEPOT_DRAIN, mag->count, mag, NULL);
+      heap_magazine_drain(heap, mag);
+      heap_free(heap, mag);
     }
+    heap->depot.nfull[class] = 0;
 
-    if (heap_major_avail(maj) >= size) {
-      heap_trace(heap, "found major with enough space");
-      min = heap_major_alloc(heap, maj, size);
-      if (min) {
-        heap_trace(heap, "done: allocated from major");
-        return heap_minor_to(min);
-      }
-      heap_trace(heap, "major doesn't have enough  contiguous space");
+    while ((mag = heap->depot.empty[class])) {
+      heap->depot.empty[class] = mag->next;
+      heap_free(heap, mag);
     }
+  }
+}
 
-    heap_trace(heap, "moving to next major");
-    prev = maj;
-    maj = maj->next;
+/* Heap functions */
+
+/* The public entry points pass their caller down as the profiler's call
+ * site, the return address in here would point into the heap itself. */
+void *heap_alloc_at(heap *heap, usize size, void *site) {
+  heap_minor *min;
+  void *ptr;
+
+  heap->stats.allocs++;
+
+  if (size == 0)
+    return NULL;
+
+  if (heap->prof.rate && heap_prof_sample(heap, size))
+    return heap_prof_alloc(heap, size, site);
+
+  if (size <= HEAP_SLAB_MAX) {
+    ptr = heap_slab_alloc(heap, size);
+    heap_trace(heap, HEAP_OP_ALLOC, size, ptr,
+               ptr ? heap_slab_from(heap, ptr) : NULL);
+    return ptr;
   }
 
-  heap_trace(heap, "no major with enough space, creating new major");
-  maj = heap_major_create(heap, size);
-  heap_node_append(&prev->base, &maj->base);
-  min = heap_minor_create(maj, size);
+  size = HEAP_ALIGNED(size);
+
+  if (size > heap_large_threshold(heap)) {
+    ptr = heap_large_alloc(heap, size);
+    heap_trace(heap, HEAP_OP_ALLOC, size, ptr,
+               ptr ? heap_large_from(ptr) : NULL);
+    return ptr;
+  }
 
-  heap_trace(heap, "done: created new major");
+  min = heap_minor_get(heap, size);
+  if (!min)
+    return NULL;
+
+  heap_trace(heap, HEAP_OP_ALLOC, size, heap_minor_to(min), min->major);
   return heap_minor_to(min);
 }
 
+void *heap_alloc(heap *heap, usize size) {
+  return heap_alloc_at(heap, size, __builtin_return_address(0));
+}
+
 void *heap_realloc(heap *heap, void *ptr, usize size) {
+  void *site = __builtin_return_address(0);
   void *nptr;
   heap_minor *min;
-
-  size = HEAP_ALIGNED(size);
+  heap_slab *slab;
+  heap_large *large;
+  usize old;
 
   if (ptr == NULL)
-    return heap_alloc(heap, size);
+    return heap_alloc_at(heap, size, site);
 
   if (size == 0) {
     heap_free(heap, ptr);
     return NULL;
   }
 
+  heap->stats.reallocs++;
+
+  slab = heap_slab_from(heap, ptr);
+  if (slab) {
+    if (size <= HEAP_SLAB_MAX && heap_slab_class(size) == slab->class) {
+      heap_trace(heap, HEAP_OP_REALLOC, size, ptr, slab);
+      return ptr;
+    }
+
+    heap->stats.slow_reallocs++;
+    old = heap_slab_class_size(slab->class);
+    nptr = heap_alloc_at(heap, size, site);
+    if (!nptr)
+      return NULL;
+    mem_copy((bytes){size < old ? size : old, nptr}, (bytes){old, ptr});
+    heap->stats.frees++;
+    heap_trace(heap, HEAP_OP_FREE, old, ptr, slab);
+    heap_slab_free(heap, slab, ptr);
+    heap_trace(heap, HEAP_OP_REALLOC, size, nptr, NULL);
+    return nptr;
+  }
+
+  size = HEAP_ALIGNED(size);
+
+  large = heap_large_from(ptr);
+  if (large->magic == HEAP_LARGE_MAGIC) {
+    if (size > heap_large_threshold(heap) &&
+        heap_large_resize(heap, large, size)) {
+      heap_trace(heap, HEAP_OP_REALLOC, size, ptr, large);
+      return ptr;
+    }
+
+    heap->stats.slow_reallocs++;
+    nptr = heap_alloc_at(heap, size, site);
+    if (!nptr)
+      return NULL;
+    old = large->used;
+    mem_copy((bytes){size < old ? size : old, nptr}, (bytes){old, ptr});
+    heap->stats.frees++;
+    heap_trace(heap, HEAP_OP_FREE, old, ptr, large);
+    if (large->site)
+      heap_prof_release(heap, large->site, large->weight);
+    heap_large_free(heap, large);
+    heap_trace(heap, HEAP_OP_REALLOC, size, nptr, NULL);
+    return nptr;
+  }
+
   min = heap_minor_from(ptr);
 
   if (!heap_node_check(heap, &min->base))
     return NULL;
 
-  if (min->size >= size) {
+  if (min->size >= size || heap_minor_grow(heap, min, size)) {
+    heap->stats.in_use += size - min->used;
     heap_minor_resize(min, size);
+    heap_minor_trim(heap, min);
+    heap_trace(heap, HEAP_OP_REALLOC, size, ptr, min->major);
     return ptr;
   }
 
-  nptr = heap_alloc(heap, size);
-  mem_copy((bytes){min->size, nptr}, (bytes){min->size, ptr});
+  heap->stats.slow_reallocs++;
+  nptr = heap_alloc_at(heap, size, site);
+  if (!nptr)
+    return NULL;
+  mem_copy((bytes){min->used, nptr}, (bytes){min->used, ptr});
   heap_free(heap, ptr);
+  heap_trace(heap, HEAP_OP_REALLOC, size, nptr, NULL);
   return nptr;
 }
 
 void *heap_calloc(heap *heap, usize num, usize size) {
-  void *ptr = heap_alloc(heap, num * size);
-  mem_zero((bytes){num * size, ptr});
+  usize total;
+  void *ptr;
+
+  if (__builtin_mul_overflow(num, size, &total))
+    return NULL;
+
+  ptr = heap_alloc_at(heap, total, __builtin_return_address(0));
+  if (ptr)
+    mem_zero((bytes){total, ptr});
   return ptr;
 }
 
 void heap_free(heap *heap, void *ptr) {
   heap_minor *min;
+  heap_slab *slab;
+  heap_large *large;
 
   if (!ptr) {
     heap_error(heap, "freeing NULL pointer");
     return;
   }
 
+  heap->stats.frees++;
+
+  slab = heap_slab_from(heap, ptr);
+  if (slab) {
+    heap_trace(heap, HEAP_OP_FREE, heap_slab_class_size(slab->class), ptr,
+               slab);
+    heap_slab_free(heap, slab, ptr);
+    return;
+  }
+
+  large = heap_large_from(ptr);
+  if (large->magic == HEAP_LARGE_MAGIC) {
+    heap_trace(heap, HEAP_OP_FREE, large->used, ptr, large);
+    if (large->site)
+      heap_prof_release(heap, large->site, large->weight);
+    heap_large_free(heap, large);
+    return;
+  }
+
   min = heap_minor_from(ptr);
 
   if (!heap_node_check(heap, &min->base))
     return;
 
+  heap_trace(heap, HEAP_OP_FREE, min->used, ptr, min->major);
+  if (min->site)
+    heap_prof_release(heap, min->site, min->weight);
   heap_minor_free(heap, min);
-}
\ No newline at end of file
+}
+
+usize heap_alloc_batch(heap *heap, usize size, usize n, void **out) {
+  usize i = 0, run, max, total;
+  heap_minor *min;
+
+  if (size == 0)
+    return 0;
+
+  /* A sampled batch tags its first object, the rest are served as usual. */
+  if (heap->prof.rate && n && heap_prof_sample(heap, size * n)) {
+    out[0] = heap_prof_alloc(heap, size, __builtin_return_address(0));
+    if (!out[0])
+      return 0;
+    i = 1;
+  }
+
+  if (size <= HEAP_SLAB_MAX) {
+    for (; i < n; i++) {
+      out[i] = heap_slab_alloc(heap, size);
+      if (!out[i])
+        break;
+    }
+
+    heap->stats.allocs += i;
+    return i;
+  }
+
+  size = HEAP_ALIGNED(size);
+
+  if (size > heap_large_threshold(heap)) {
+    for (; i < n; i++) {
+      out[i] = heap_large_alloc(heap, size);
+      if (!out[i])
+        break;
+    }
+
+    heap->stats.allocs += i;
+    return i;
+  }
+
+  /* Take one minor big enough for a run of blocks and split it in place,
+   * runs are capped so they don't turn into a single huge major. */
+  max = heap_large_threshold(heap) / (size + HEAP_ALIGN);
+  max = max ? max : 1;
+
+  while (i < n) {
+    run = n - i < max ? n - i : max;
+    total = run * (size + HEAP_ALIGN) - HEAP_ALIGN;
+
+    min = heap_minor_get(heap, total);
+    if (!min)
+      break;
+
+    heap->stats.in_use -= total - run * size;
+    heap_minor_resize(min, size);
+    out[i++] = heap_minor_to(min);
+    heap_trace(heap, HEAP_OP_ALLOC, size, heap_minor_to(min), min->major);
+
+    while (--run) {
+      min = heap_minor_split(heap, min, size);
+      out[i++] = heap_minor_to(min);
+      heap_trace(heap, HEAP_OP_ALLOC, size, heap_minor_to(min), min->major);
+    }
+  }
+
+  heap->stats.allocs += i;
+  return i;
+}
+
+void heap_free_batch(heap *heap, void **ptrs, usize n) {
+  heap_minor *min, *next;
+  heap_slab *slab;
+  heap_large *large;
+
+  /* Nothing goes back to the alloc hook until the end, so headers of blocks
+   * merged away earlier in the batch stay readable. */
+  heap->batch++;
+
+  /* First pass frees slab objects and marks minors as pending, a pending
+   * minor is unused and self-linked instead of being in the index. */
+  for (usize i = 0; i < n; i++) {
+    if (!ptrs[i])
+      continue;
+
+    slab = heap_slab_from(heap, ptrs[i]);
+    if (slab) {
+      heap->stats.frees++;
+      heap_trace(heap, HEAP_OP_FREE, heap_slab_class_size(slab->class),
+                 ptrs[i], slab);
+      heap_slab_free(heap, slab, ptrs[i]);
+      continue;
+    }
+
+    if (heap_large_from(ptrs[i])->magic == HEAP_LARGE_MAGIC)
+      continue;
+
+    min = heap_minor_from(ptrs[i]);
+    if (!heap_node_check(heap, &min->base))
+      continue;
+
+    heap->stats.frees++;
+    heap_trace(heap, HEAP_OP_FREE, min->used, ptrs[i], min->major);
+    if (min->site)
+      heap_prof_release(heap, min->site, min->weight);
+
+    heap->stats.in_use -= min->used;
+    min->major->used -= min->used;
+    min->used = 0;
+    min->prev_free = min;
+    min->next_free = min;
+  }
+
+  /* Second pass frees large blocks and coalesces each run of unused minors
+   * once, starting from the first minor of the run. */
+  for (usize i = 0; i < n; i++) {
+    if (!ptrs[i] || heap_slab_from(heap, ptrs[i]))
+      continue;
+
+    large = heap_large_from(ptrs[i]);
+    if (large->magic == HEAP_LARGE_MAGIC) {
+      heap->stats.frees++;
+      heap_trace(heap, HEAP_OP_FREE, large->used, ptrs[i], large);
+      if (large->site)
+        heap_prof_release(heap, large->site, large->weight);
+      heap_large_free(heap, large);
+      continue;
+    }
+
+    min = heap_minor_from(ptrs[i]);
+    if (min->magic != HEAP_MAGIC || min->prev_free != min)
+      continue;
+
+    while (min->prev && !min->prev->used)
+      min = min->prev;
+
+    if (min->prev_free == min) {
+      min->prev_free = NULL;
+      min->next_free = NULL;
+    } else {
+      heap_index_remove(heap, min);
+    }
+
+    while ((next = min->next) && !next->used) {
+      /* Merging takes next out of the index, index pending ones first. */
+      if (next->prev_free == next)
+        heap_index_insert(heap, next);
+      heap_minor_merge(heap, min);
+    }
+
+    if (!min->prev && !min->next) {
+      heap_major_retain(heap, min->major);
+      continue;
+    }
+
+    heap_index_insert(heap, min);
+  }
+
+  heap->batch--;
+  if (!heap->batch)
+    heap_settle(heap);
+}
+
+void heap_settle(heap *heap) {
+  heap_slab *slab, *next;
+
+  heap_spare_settle(heap);
+
+  for (usize class = 0; class < HEAP_SLAB_CLASSES; class++) {
+    for (slab = heap->slabs[class]; slab; slab = next) {
+      next = slab->next;
+      if (!slab->used && (slab->prev || slab->next))
+        heap_slab_destroy(heap, slab);
+    }
+  }
+}
+
+void heap_trim(heap *heap) {
+  heap_slab *slab, *next;
+
+  heap_depot_drain(heap);
+  heap_spare_trim(heap, 0, 0);
+
+  for (usize class = 0; class < HEAP_SLAB_CLASSES; class++) {
+    for (slab = heap->slabs[class]; slab; slab = next) {
+      next = slab->next;
+      if (!slab->used)
+        heap_slab_destroy(heap, slab);
+    }
+  }
+}
+
+/* Stats functions */
+
+usize heap_largest_free(heap *heap) {
+  heap_index *index = &heap->index;
+  heap_minor *min;
+  usize fl, sl, largest = 0;
+
+  if (!index->fl)
+    return 0;
+
+  fl = 31 - __builtin_clz(index->fl);
+  sl = 31 - __builtin_clz(index->sl[fl]);
+
+  for (min = index->free[fl][sl]; min; min = min->next_free) {
+    if (min->size > largest)
+      largest = min->size;
+  }
+
+  return largest;
+}
+
+/* Per mille of free memory outside the largest free block. Both sizes are
+ * scaled down until the product fits a usize, the kernel has no 64-bit
+ * division on rv32. */
+usize heap_fragmentation(usize largest, usize free) {
+  if (!free)
+    return 0;
+
+  while (free > (usize)-1 / 1000) {
+    largest >>= 1;
+    free >>= 1;
+  }
+
+  return 1000 - (largest * 1000) / free;
+}
+
+heap_stats heap_stats_read(heap *heap) {
+  heap_stats stats = heap->stats;
+
+  stats.spares = heap->spare_count;
+  stats.largest_free = heap_largest_free(heap);
+  stats.fragmentation = heap_fragmentation(stats.largest_free, stats.free);
+
+  return stats;
+}
+
+void heap_walk(heap *heap, HeapWalkFn *fn, void *ctx) {
+  heap_occupancy occ;
+
+  for (heap_major *maj = heap->root; maj; maj = maj->next) {
+    occ = (heap_occupancy){.major = maj, .size = maj->size};
+
+    for (heap_minor *min = maj->minor; min; min = min->next) {
+      occ.minors++;
+      occ.used += min->used;
+
+      if (!min->used) {
+        occ.unused++;
+        occ.free += min->size;
+        if (min->size > occ.largest_free)
+          occ.largest_free = min->size;
+      }
+    }
+
+    fn(ctx, &occ);
+  }
+}
+
+/* Profiler functions */
+
+void heap_prof_enable(heap *heap, usize rate) {
+  heap->prof.rate = rate;
+  heap->prof.countdown = rate;
+}
+
+void heap_prof_dump(heap *heap) {
+  heap_prof_site *slot;
+
+  heap_info(heap, "heap profile (rate=%zu)", heap->prof.rate);
+
+  for (usize i = 0; i < HEAP_PROF_SITES; i++) {
+    slot = &heap->prof.sites[i];
+    if (!slot->site)
+      continue;
+
+    heap_info(heap, "  %p: %zu bytes live, %zu/%zu samples live", slot->site,
+              slot->live_bytes, slot->live_samples, slot->total_samples);
+  }
+}
+
+/* Alloc functions */
+
+void *heap_alloc_fn(void *ctx, usize n, void *buf) {
+  if (!buf)
+    return heap_alloc_at(ctx, n, __builtin_return_address(0));
+
+  if (!n) {
+    heap_free(ctx, buf);
+    return NULL;
+  }
+
+  return heap_realloc(ctx, buf, n);
+}
+
+usize heap_alloc_batch_fn(void *ctx, usize n, usize count, void **bufs) {
+  return heap_alloc_batch(ctx, n, count, bufs);
+}
+
+void heap_free_batch_fn(void *ctx, void **bufs, usize count) {
+  heap_free_batch(ctx, bufs, count);
+}
+
+alloc heap_as_alloc(heap *heap) {
+  return (alloc){
+      .ctx = heap,
+      .alloc = heap_alloc_fn,
+      .alloc_batch = heap_alloc_batch_fn,
+      .free_batch = heap_free_batch_fn,
+  };
+}
+
+/* Cache functions */
+
+void heap_cache_init(heap_cache *cache, heap *heap) {
+  *cache = (heap_cache){.heap = heap};
+}
+
+void *heap_cache_alloc(heap_cache *cache, usize size) {
+  void *site = __builtin_return_address(0);
+  heap *heap = cache->heap;
+  heap_magazine *mag;
+  usize class;
+  void *ptr;
+
+  if (size == 0 || size > HEAP_SLAB_MAX) {
+    heap_lock(heap);
+    ptr = heap_alloc_at(heap, size, site);
+    heap_unlock(heap);
+    return ptr;
+  }
+
+  /* Each cache counts down to its own samples so the fast path stays off
+   * the heap. */
+  if (heap->prof.rate) {
+    cache->countdown -= size;
+    if (cache->countdown <= 0) {
+      cache->countdown += heap->prof.rate;
+      if (cache->countdown <= 0)
+        cache->countdown = heap->prof.rate;
+
+      heap_lock(heap);
+      heap->stats.allocs++;
+      ptr = heap_prof_alloc(heap, size, site);
+      heap_unlock(heap);
+      return ptr;
+    }
+  }
+
+  class = heap_slab_class(size);
+  mag = cache->loaded[class];
+
+  if (mag && mag->count)
+    return heap_magazine_pop(mag);
+
+  if (cache->previous[class] && cache->previous[class]->count) {
+    cache->loaded[class] = cache->previous[class];
+    cache->previous[class] = mag;
+    mag = cache->loaded[class];
+    return heap_magazine_pop(mag);
+  }
+
+  heap_lock(heap);
+  heap->stats.slow_depot++;
+
+  mag = heap_depot_get(heap, class, true);
+  if (mag) {
+    if (cache->previous[class])
+      heap_depot_put(heap, class, cache->previous[class]);
+    cache->previous[class] = cache->loaded[class];
+    cache->loaded[class] = mag;
+  } else {
+    /* Nothing to reuse, refill the loaded magazine straight from the slabs
+     * while we hold the lock. */
+    mag = cache->loaded[class];
+    if (!mag)
+      mag = cache->loaded[class] = heap_depot_get(heap, class, false);
+
+    while (mag && mag->count < HEAP_MAGAZINE_SIZE / 2) {
+      ptr = heap_slab_alloc(heap, heap_slab_class_size(class));
+      if (!ptr)
+        break;
+      heap->stats.allocs++;
+      mag->objs[mag->count++] = ptr;
+    }
+  }
+
+  if (mag && mag->count) {
+    ptr = heap_magazine_pop(mag);
+  } else {
+    ptr = heap_slab_alloc(heap, size);
+    if (ptr)
+      heap->stats.allocs++;
+  }
+
+  heap_unlock(heap);
+  return ptr;
+}
+
+/* A poisoned object is confirmed free against the slab, the depot and this
+ * cache's magazines, the heap lock must be held. A copy parked in another
+ * cache's magazine goes unnoticed. */
+bool heap_cache_holds(heap_cache *cache, heap_slab *slab, void *ptr) {
+  usize class = slab->class;
+
+  if (heap_slab_is_free(slab, ptr) ||
+      heap_magazine_holds(cache->loaded[class], ptr) ||
+      heap_magazine_holds(cache->previous[class], ptr))
+    return true;
+
+  for (heap_magazine *mag = cache->heap->depot.full[class]; mag;
+       mag = mag->next)
+    if (heap_magazine_holds(mag, ptr))
+      return true;
+
+  return false;
+}
+
+void heap_cache_free(heap_cache *cache, void *ptr) {
+  heap *heap = cache->heap;
+  heap_magazine *mag;
+  heap_slab *slab;
+  usize class;
+
+  /* Slab headers are immutable while they have live objects, so probing the
+   * page doesn't need the lock. Anything else goes to the shared heap. */
+  slab = ptr ? heap_slab_from(heap, ptr) : NULL;
+  if (!slab) {
+    heap_lock(heap);
+    heap_free(heap, ptr);
+    heap_unlock(heap);
+    return;
+  }
+
+  if (HEAP_SLAB_POISON(ptr) == (uintptr_t)HEAP_SLAB_FREE) {
+    heap_lock(heap);
+    bool twice = heap_cache_holds(cache, slab, ptr);
+    if (twice)
+      heap_error(heap, "heap double free detected");
+    heap_unlock(heap);
+    if (twice)
+      return;
+  }
+
+  class = slab->class;
+  mag = cache->loaded[class];
+
+  if (mag && mag->count < HEAP_MAGAZINE_SIZE) {
+    heap_magazine_push(mag, ptr);
+    return;
+  }
+
+  if (cache->previous[class] &&
+      cache->previous[class]->count < HEAP_MAGAZINE_SIZE) {
+    cache->loaded[class] = cache->previous[class];
+    cache->previous[class] = mag;
+    mag = cache->loaded[class];
+    heap_magazine_push(mag, ptr);
+    return;
+  }
+
+  heap_lock(heap);
+  heap->stats.slow_depot++;
+
+  if (cache->previous[class])
+    heap_depot_put(heap, class, cache->previous[class]);
+  cache->previous[class] = mag;
+
+  mag = cache->loaded[class] = heap_depot_get(heap, class, false);
+  if (mag) {
+    heap_magazine_push(mag, ptr);
+  } else {
+    heap->stats.frees++;
+    heap_slab_free(heap, slab, ptr);
+  }
+
+  heap_unlock(heap);
+}
+
+void heap_cache_flush(heap_cache *cache) {
+  heap *heap = cache->heap;
+
+  heap_lock(heap);
+
+  for (usize class = 0; class < HEAP_SLAB_CLASSES; class++) {
+    heap_magazine *mags[] = {cache->loaded[class], cache->previous[class]};
+
+    for (usize i = 0; i < 2; i++) {
+      if (!mags[i])
+        continue;
+      heap_magazine_drain(heap, mags[i]);
+      heap_depot_put(heap, class, mags[i]);
+    }
+
+    cache->loaded[class] = NULL;
+    cache->previous[class] = NULL;
+  }
+
+  heap_unlock(heap);
+}
@@ -1,12 +1,28 @@
 #pragma once
 
+#include "alloc.h"
 #include "base.h"
 
 #define HEAP_MAGIC 0xc0c0c0c0c0c0c0c0
 #define HEAP_DEAD 0xdeaddeaddeaddead
+#define HEAP_SLAB_MAGIC 0x5151515151515151
+#define HEAP_LARGE_MAGIC 0x1a1a1a1a1a1a1a1a
+#define HEAP_SLAB_FREE 0xf5f5f5f5f5f5f5f5
 #define HEAP_ALIGN (64)
 #define HEAP_PAGE_SIZE (4096)
 #define HEAP_MIN_REQU (4096 * 4)
+#define HEAP_SLAB_SIZE HEAP_PAGE_SIZE
+#define HEAP_SLAB_MAX (256)
+#define HEAP_SLAB_CLASSES (8)
+#define HEAP_INDEX_FL (32)
+#define HEAP_INDEX_SL_BITS (3)
+#define HEAP_INDEX_SL (1 << HEAP_INDEX_SL_BITS)
+#define HEAP_MAGAZINE_SIZE (14)
+#define HEAP_DEPOT_MAX (8)
+#define HEAP_LARGE_DEFAULT (HEAP_MIN_REQU / 2)
+#define HEAP_RETAIN_MAJORS (4)
+#define HEAP_RETAIN_BYTES (HEAP_MIN_REQU * 8)
+#define HEAP_PROF_SITES (64)
 #define HEAP_ALIGNED(X) (((X) + (HEAP_ALIGN - 1)) & ~(HEAP_ALIGN - 1))
 #define HEAP_PAGE_ALIGNED(X)                                                   \
   (((X) + (HEAP_PAGE_SIZE - 1)) & ~(HEAP_PAGE_SIZE - 1))
@@ -44,25 +60,220 @@ typedef struct heap_minor {
   usize size;
   usize used;
   struct heap_major *major;
+
+  union {
+    /* Links in the free index, while the minor is unused */
+    struct {
+      struct heap_minor *prev_free;
+      struct heap_minor *next_free;
+    };
+
+    /* Sampled callsite and the bytes it was charged, while in use */
+    struct {
+      void *site;
+      usize weight;
+    };
+  };
 } heap_minor;
 
+_Static_assert(sizeof(heap_minor) <= HEAP_ALIGN, "heap minor too big");
+
+/* Two-level segregated index of unused minors: the first level splits sizes
+ * by power of two, the second level splits each power of two in
+ * HEAP_INDEX_SL linear steps. The bitmaps let a fitting list be found with a
+ * couple of bit scans. */
+typedef struct {
+  u32 fl;
+  u32 sl[HEAP_INDEX_FL];
+  heap_minor *free[HEAP_INDEX_FL][HEAP_INDEX_SL];
+} heap_index;
+
+/* Slabs are page-aligned pages carved into objects of a single size class.
+ * The header lives at the start of the page so objects don't need one, the
+ * owning slab is found by masking the object address. */
+typedef struct heap_slab {
+  HEAP_NODE(struct heap_slab);
+
+  struct heap *heap;
+  usize class;
+  usize used;
+  void *free;
+} heap_slab;
+
+/* A magazine is a stack of free slab objects of a single size class. Caches
+ * exchange whole magazines with the depot, so the shared lock is taken once
+ * every HEAP_MAGAZINE_SIZE operations at most. */
+typedef struct heap_magazine {
+  struct heap_magazine *next;
+  usize count;
+  void *objs[HEAP_MAGAZINE_SIZE];
+} heap_magazine;
+
+typedef struct {
+  heap_magazine *full[HEAP_SLAB_CLASSES];
+  heap_magazine *empty[HEAP_SLAB_CLASSES];
+  usize nfull[HEAP_SLAB_CLASSES];
+} heap_depot;
+
+/* Large allocations get their own block from the alloc hook with a single
+ * header in front, they are never carved into minors. */
+typedef struct heap_large {
+  HEAP_NODE(struct heap_large);
+
+  usize size;
+  usize used;
+  void *site;
+  usize weight;
+} heap_large;
+
+/* Counters are maintained as the heap runs, the derived fields (largest_free,
+ * fragmentation, spares) are filled in by heap_stats_read. */
+typedef struct {
+  usize in_use;        /* bytes handed out, after size class rounding */
+  usize reserved;      /* bytes held from the alloc hook */
+  usize free;          /* bytes in unused minors */
+  usize largest_free;  /* biggest unused minor */
+  usize fragmentation; /* 1 - largest_free / free, in permille */
+
+  usize majors;
+  usize minors;
+  usize slabs;
+  usize large;
+  usize spares;
+
+  /* Moving reallocs count as an alloc and a free. Caches are counted where
+   * slab objects enter and leave them, not per cached operation. */
+  usize allocs;
+  usize frees;
+  usize reallocs;
+
+  usize slow_majors;   /* allocations that missed the index */
+  usize slow_slabs;    /* slab pages created */
+  usize slow_reallocs; /* reallocs that had to move */
+  usize slow_depot;    /* cache operations that went to the depot */
+} heap_stats;
+
+typedef struct {
+  heap_major *major;
+  usize size;
+  usize used;
+  usize free;
+  usize largest_free;
+  usize minors;
+  usize unused;
+} heap_occupancy;
+
+typedef void HeapWalkFn(void *ctx, heap_occupancy const *occ);
+
+/* Sampling profiler: roughly one allocation every `rate` bytes is tagged with
+ * its caller and served from a minor or large block so the header can hold
+ * the tag. Each sample is charged max(size, rate) bytes to its callsite. */
+typedef struct {
+  void *site;
+  usize live_bytes;
+  usize live_samples;
+  usize total_samples;
+} heap_prof_site;
+
+typedef struct {
+  usize rate;
+  isize countdown;
+  heap_prof_site sites[HEAP_PROF_SITES];
+} heap_prof;
+
 typedef void HeapFreeBlockFn(void *ctx, void *ptr, usize size);
 
 enum HeapLogType {
-  HEAP_TRACE,
   HEAP_ERROR,
+  HEAP_INFO,
+};
+
+/* Tracing is compiled out unless the heap is built with -DHEAP_TRACING. When
+ * enabled, trace points append fixed-size binary events to a ring buffer
+ * supplied by the user, which can be read back and decoded offline (see
+ * meta/plugins/heap.py). */
+enum heap_op {
+  HEAP_OP_ALLOC,
+  HEAP_OP_FREE,
+  HEAP_OP_REALLOC,
+  HEAP_OP_MAJOR_CREATE,
+  HEAP_OP_MAJOR_FREE,
+  HEAP_OP_MAJOR_GROW,
+  HEAP_OP_SPLIT,
+  HEAP_OP_MERGE,
+  HEAP_OP_SLAB_CREATE,
+  HEAP_OP_SLAB_DESTROY,
+  HEAP_OP_SLAB_FULL,
+  HEAP_OP_DEPOT_DRAIN,
 };
 
+/* Layout is the same on every target so dumps decode the same way */
 typedef struct {
+  u64 time;
+  u64 ptr;
+  u64 major;
+  u32 size;
+  u32 op;
+} heap_event;
+
+typedef struct {
+  heap_event *buf;
+  usize len;
+  usize head;
+  usize tail;
+  usize lost;
+  u64 (*clock)(void *ctx);
+} heap_tracer;
+
+/* The alloc hook must return HEAP_PAGE_SIZE aligned blocks. The grow hook is
+ * optional, it extends a block in place and returns false if it can't.
+ * Requests above large_threshold (HEAP_LARGE_DEFAULT when zero) bypass the
+ * majors. Up to retain_majors empty majors totalling retain_bytes are kept
+ * on the spare list (HEAP_RETAIN_MAJORS and HEAP_RETAIN_BYTES when zero). */
+typedef struct heap {
   void *ctx;
   void *(*alloc)(void *ctx, usize size);
   void (*free)(void *ctx, void *ptr, usize size);
+  bool (*grow)(void *ctx, void *ptr, usize size, usize new_size);
   void (*log)(void *ctx, enum HeapLogType type, cstr fmt, va_list args);
 
   heap_major *root;
-  heap_major *best;
+  heap_index index;
+
+  usize retain_majors;
+  usize retain_bytes;
+  heap_major *spare;
+  usize spare_count;
+  usize spare_bytes;
+  heap_slab *slabs[HEAP_SLAB_CLASSES];
+
+  usize large_threshold;
+  heap_large *large;
+
+  atomic_flag lock;
+  heap_depot depot;
+
+  heap_stats stats;
+  heap_prof prof;
+
+  /* Nesting depth of batch frees, releases to the alloc hook are deferred
+   * while it is non zero. */
+  usize batch;
+
+#ifdef HEAP_TRACING
+  heap_tracer tracer;
+#endif
 } heap;
 
+/* Per-hart front-end over a shared heap. The fast paths only touch the
+ * cache, the heap lock is taken when magazines run full or empty. */
+typedef struct {
+  heap *heap;
+  heap_magazine *loaded[HEAP_SLAB_CLASSES];
+  heap_magazine *previous[HEAP_SLAB_CLASSES];
+  isize countdown;
+} heap_cache;
+
 /* ---- Internal functions -------------------------------------------------- */
 
 /* Heap hook functions */
@@ -71,10 +282,28 @@ void *heap_alloc_block(heap *heap, usize size);
 
 void heap_free_block(heap *heap, void *ptr, usize size);
 
-void heap_trace(heap *heap, cstr msg, ...);
+bool heap_grow_block(heap *heap, void *ptr, usize size, usize new_size);
 
 void heap_error(heap *heap, cstr msg, ...);
 
+void heap_info(heap *heap, cstr msg, ...);
+
+/* Heap trace functions */
+
+#ifdef HEAP_TRACING
+
+void heap_trace_record(heap *heap, enum heap_op op, usize size, void *ptr,
+                       void *major);
+
+#define heap_trace(HEAP, OP, SIZE, PTR, MAJOR)                               \
+    heap_trace_record(HEAP, OP, SIZE, PTR, MAJOR)
+
+#else
+
+#define heap_trace(HEAP, OP, SIZE, PTR, MAJOR) ((void)0)
+
+#endif
+
 /* Heap node functions */
 
 bool heap_node_check(heap *heap, heap_node *node);
@@ -85,23 +314,57 @@ void heap_node_prepend(heap_node *node, heap_node *other);
 
 void heap_node_remove(heap_node *node);
 
+/* Heap index functions */
+
+void heap_index_mapping(usize size, usize *fl, usize *sl);
+
+void heap_index_insert(heap *heap, heap_minor *min);
+
+void heap_index_remove(heap *heap, heap_minor *min);
+
+heap_minor *heap_index_find(heap *heap, usize size);
+
 /* Heap major functions */
 
 usize heap_major_avail(struct heap_major *maj);
 
 struct heap_major *heap_major_create(heap *heap, usize size);
 
-heap_minor *heap_major_alloc(heap *heap, struct heap_major *maj, usize size);
+bool heap_major_grow(heap *heap, struct heap_major *maj, usize size);
 
 void heap_major_free(heap *heap, struct heap_major *maj);
 
+void heap_major_retain(heap *heap, struct heap_major *maj);
+
+struct heap_major *heap_major_reuse(heap *heap, usize size);
+
+/* Heap spare functions */
+
+usize heap_retain_majors(heap *heap);
+
+usize heap_retain_bytes(heap *heap);
+
+void heap_spare_settle(heap *heap);
+
+void heap_spare_trim(heap *heap, usize majors, usize bytes);
+
 /* Heap minor functions */
 
 usize heap_minor_avail(heap_minor *min);
 
 heap_minor *heap_minor_create(struct heap_major *maj, usize size);
 
-heap_minor *heap_minor_split(heap_minor *min, usize size);
+heap_minor *heap_minor_split(heap *heap, heap_minor *min, usize size);
+
+void heap_minor_alloc(heap *heap, heap_minor *min, usize size);
+
+heap_minor *heap_minor_get(heap *heap, usize size);
+
+void heap_minor_trim(heap *heap, heap_minor *min);
+
+void heap_minor_merge(heap *heap, heap_minor *min);
+
+bool heap_minor_grow(heap *heap, heap_minor *min, usize size);
 
 void heap_minor_free(heap *heap, heap_minor *min);
 
@@ -111,6 +374,70 @@ heap_minor *heap_minor_from(void *ptr);
 
 void *heap_minor_to(heap_minor *min);
 
+/* Heap slab functions */
+
+bool heap_slab_is_free(heap_slab *slab, void *ptr);
+
+usize heap_slab_class(usize size);
+
+usize heap_slab_class_size(usize class);
+
+heap_slab *heap_slab_create(heap *heap, usize class);
+
+void heap_slab_destroy(heap *heap, heap_slab *slab);
+
+void *heap_slab_alloc(heap *heap, usize size);
+
+void heap_slab_free(heap *heap, heap_slab *slab, void *ptr);
+
+heap_slab *heap_slab_from(heap *heap, void *ptr);
+
+/* Heap large functions */
+
+usize heap_large_threshold(heap *heap);
+
+void *heap_large_alloc(heap *heap, usize size);
+
+bool heap_large_resize(heap *heap, heap_large *large, usize size);
+
+void heap_large_free(heap *heap, heap_large *large);
+
+heap_large *heap_large_from(void *ptr);
+
+/* Heap profiler functions */
+
+bool heap_prof_sample(heap *heap, usize size);
+
+heap_prof_site *heap_prof_lookup(heap *heap, void *site);
+
+void *heap_prof_alloc(heap *heap, usize size, void *site);
+
+void heap_prof_release(heap *heap, void *site, usize weight);
+
+void *heap_alloc_at(heap *heap, usize size, void *site);
+
+/* Heap lock functions */
+
+void heap_lock(heap *heap);
+
+void heap_unlock(heap *heap);
+
+/* Heap depot functions, the heap lock must be held */
+
+heap_magazine *heap_depot_get(heap *heap, usize class, bool full);
+
+void heap_depot_put(heap *heap, usize class, heap_magazine *mag);
+
+void *heap_magazine_pop(heap_magazine *mag);
+
+void heap_magazine_push(heap_magazine *mag, void *ptr);
+
+bool heap_magazine_holds(heap_magazine *mag, void *ptr);
+
+void heap_magazine_drain(heap *heap, heap_magazine *mag);
+
+void heap_depot_drain(heap *heap);
+
 /* ---- Public functions ---------------------------------------------------- */
 
 void *heap_alloc(heap *heap, usize size);
@@ -120,3 +447,59 @@ void *heap_realloc(heap *heap, void *ptr, usize size);
 void *heap_calloc(heap *heap, usize num, usize size);
 
 void heap_free(heap *heap, void *ptr);
+
+usize heap_alloc_batch(heap *heap, usize size, usize n, void **out);
+
+void heap_free_batch(heap *heap, void **ptrs, usize n);
+
+void heap_settle(heap *heap);
+
+/* Also empties the depot, the heap lock must be held when caches share the
+ * heap. */
+void heap_trim(heap *heap);
+
+/* ---- Stats functions ----------------------------------------------------- */
+
+usize heap_largest_free(heap *heap);
+
+usize heap_fragmentation(usize largest, usize free);
+
+heap_stats heap_stats_read(heap *heap);
+
+void heap_walk(heap *heap, HeapWalkFn *fn, void *ctx);
+
+/* ---- Profiler functions -------------------------------------------------- */
+
+void heap_prof_enable(heap *heap, usize rate);
+
+void heap_prof_dump(heap *heap);
+
+#ifdef HEAP_TRACING
+
+void heap_trace_attach(heap *heap, heap_event *buf, usize len,
+                       u64 (*clock)(void *ctx));
+
+usize heap_trace_read(heap *heap, heap_event *buf, usize len);
+
+#endif
+
+/* ---- Alloc functions ----------------------------------------------------- */
+
+/* An alloc backed by the heap, batches go through heap_alloc_batch and
+ * heap_free_batch. Locking is left to the caller as with the functions
+ * above. */
+alloc heap_as_alloc(heap *heap);
+
+/* ---- Cache functions ----------------------------------------------------- */
+
+void heap_cache_init(heap_cache *cache, heap *heap);
+
+void *heap_cache_alloc(heap_cache *cache, usize size);
+
+/* Whether a slab object is already free in its slab, the depot or this
+ * cache, the heap lock must be held. */
+bool heap_cache_holds(heap_cache *cache, heap_slab *slab, void *ptr);
+
+void heap_cache_free(heap_cache *cache, void *ptr);
+
+void heap_cache_flush(heap_cache *cache);
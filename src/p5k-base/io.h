@@ -11,15 +11,15 @@ typedef struct {
   isize off;
 } io_whence;
 
-inline io_whence io_whence_curr(isize off) {
+static inline io_whence io_whence_curr(isize off) {
   return (io_whence){IO_WHENCE_CURR, off};
 }
 
-inline io_whence io_whence_start(isize off) {
+static inline io_whence io_whence_start(isize off) {
   return (io_whence){IO_WHENCE_START, off};
 }
 
-inline io_whence io_whence_end(isize off) {
+static inline io_whence io_whence_end(isize off) {
   return (io_whence){IO_WHENCE_END, off};
 }
 
@@ -86,6 +86,45 @@ res io_vprint(io io, str fmt, va_list vargs) {
           int nibble = (value >> (i * 4)) & 0xf;
           written += try(io_putc(io, "0123456789abcdef"[nibble])).uvalue;
         }
+        break;
+      }
+      case 'z': {
+        usize value;
+        if (f[1] == 'd') {
+          f++;
+          isize signed_value = va_arg(vargs, isize);
+          value = (usize)signed_value;
+          if (signed_value < 0) {
+            written += try(io_putc(io, '-')).uvalue;
+            value = -value;
+          }
+        } else {
+          if (f[1] == 'u')
+            f++;
+          value = va_arg(vargs, usize);
+        }
+
+        usize divisor = 1;
+        while (value / divisor > 9)
+          divisor *= 10;
+
+        while (divisor > 0) {
+          written += try(io_putc(io, '0' + value / divisor)).uvalue;
+          value %= divisor;
+          divisor /= 10;
+        }
+
+        break;
+      }
+      case 'p': {
+        uintptr_t value = (uintptr_t)va_arg(vargs, void *);
+        written += try(io_putc(io, '0')).uvalue;
+        written += try(io_putc(io, 'x')).uvalue;
+        for (int i = sizeof(value) * 2 - 1; i >= 0; i--) {
+          int nibble = (value >> (i * 4)) & 0xf;
+          written += try(io_putc(io, "0123456789abcdef"[nibble])).uvalue;
+        }
+        break;
       }
       }
     } else {
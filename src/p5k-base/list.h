@@ -21,7 +21,7 @@ typedef struct {
  * @param l The list to apply the function to.
  * @param f The function to apply to each element in the list.
  */
-inline void list_apply(list l ref, void (*f)(void *)) {
+static inline void list_apply(list l ref, void (*f)(void *)) {
   for (list_node *n = l->head; n != nil; n = n->next) {
     f(n->data);
   }
@@ -33,7 +33,7 @@ inline void list_apply(list l ref, void (*f)(void *)) {
  * @param l The list to add the element to.
  * @param data A pointer to the data to be added to the list.
  */
-inline void list_push(list l ref, void *data) {
+static inline void list_push(list l ref, void *data) {
   list_node *n = alloc_allocz(l->alloc, sizeof(list_node));
   n->data = data;
   n->next = nil;
@@ -58,7 +58,7 @@ inline void list_push(list l ref, void *data) {
  * is empty, it returns NULL. The memory of the removed element is freed using
  * the allocator of the list.
  */
-inline void *list_pop(list l ref) {
+static inline void *list_pop(list l ref) {
   if (l->tail == nil) {
     return nil;
   }
@@ -81,7 +81,7 @@ inline void *list_pop(list l ref) {
  * @param l The list to insert the node into.
  * @param data The data to store in the new node.
  */
-inline void list_unshift(list l ref, void *data) {
+static inline void list_unshift(list l ref, void *data) {
   list_node *n = alloc_allocz(l->alloc, sizeof(list_node));
   n->data = data;
   n->next = l->head;
@@ -103,7 +103,7 @@ inline void list_unshift(list l ref, void *data) {
  * @param l The list to remove the element from.
  * @return The data of the removed element, or `nil` if the list is empty.
  */
-inline void *list_shift(list l ref) {
+static inline void *list_shift(list l ref) {
   if (l->head == nil) {
     return nil;
   }
@@ -128,7 +128,7 @@ inline void *list_shift(list l ref) {
  * @param data The data to store in the new node.
  * @param index The index at which to insert the new node.
  */
-inline void list_insert(list l ref, void *data, usize index) {
+static inline void list_insert(list l ref, void *data, usize index) {
   list_node *n = alloc_allocz(l->alloc, sizeof(list_node));
   n->data = data;
   if (index == 0) {
@@ -174,7 +174,7 @@ inline void list_insert(list l ref, void *data, usize index) {
  * @return A pointer to the data of the removed element, or `nil` if the index
  * is out of bounds or the list is empty.
  */
-inline void *list_remove(list l ref, usize index) {
+static inline void *list_remove(list l ref, usize index) {
   if (index == 0) {
     return list_shift(l);
   }
@@ -210,7 +210,7 @@ inline void *list_remove(list l ref, usize index) {
  * @return A pointer to the data at the specified index, or `nil` if the index
  * is out of bounds.
  */
-inline void *list_get(list l ref, usize index) {
+static inline void *list_get(list l ref, usize index) {
   list_node *n = l->head;
   while (index > 0 && n != nil) {
     n = n->next;
@@ -231,7 +231,7 @@ inline void *list_get(list l ref, usize index) {
  * @return A pointer to the old data at the specified index, or `nil` if the
  * index is out of bounds.
  */
-inline void *list_set(list l ref, usize index, void *data) {
+static inline void *list_set(list l ref, usize index, void *data) {
   list_node *n = l->head;
   while (index > 0 && n != nil) {
     n = n->next;
@@ -253,7 +253,7 @@ inline void *list_set(list l ref, usize index, void *data) {
  * @param l A reference to the list to get the length of.
  * @return The length of the list.
  */
-inline usize list_len(list l ref) {
+static inline usize list_len(list l ref) {
   usize len = 0;
   for (list_node *n = l->head; n != nil; n = n->next) {
     len++;
@@ -269,7 +269,7 @@ inline usize list_len(list l ref) {
  *
  * @param l A reference to the list to clear.
  */
-inline void list_clear(list l ref) {
+static inline void list_clear(list l ref) {
   while (l->head != nil) {
     list_shift(l);
   }
@@ -283,7 +283,7 @@ inline void list_clear(list l ref) {
  * @param l A reference to the list to enqueue the data to.
  * @param data A pointer to the data to enqueue.
  */
-inline void list_enqueue(list l ref, void *data) { list_push(l, data); }
+static inline void list_enqueue(list l ref, void *data) { list_push(l, data); }
 
 /**
  * @brief Removes and returns the first element of the list.
@@ -291,7 +291,7 @@ inline void list_enqueue(list l ref, void *data) { list_push(l, data); }
  * @param l The list to dequeue from.
  * @return void* A pointer to the first element of the list.
  */
-inline void *list_dequeue(list l ref) { return list_shift(l); }
+static inline void *list_dequeue(list l ref) { return list_shift(l); }
 
 /**
  * @brief Requeues the first element of the list to the end of the list.
@@ -299,7 +299,7 @@ inline void *list_dequeue(list l ref) { return list_shift(l); }
  * @param l The list to requeue the element in.
  * @return void* A pointer to the data of the requeued element, or NULL if the list is empty.
  */
-inline void *list_requeue(list l ref) {
+static inline void *list_requeue(list l ref) {
   if (l->head == nil) {
     return nil;
   }
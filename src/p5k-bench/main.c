@@ -0,0 +1,547 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <p5k-base/heap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_SLOTS (4096)
+#define BENCH_QUEUE (16384)
+#define BENCH_VECTORS (64)
+#define BENCH_VECTOR_MAX (256 * 1024)
+#define BENCH_HIST_SUB_BITS (3)
+#define BENCH_HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define BENCH_HIST_BUCKETS (64 * BENCH_HIST_SUB)
+
+typedef struct {
+  u64 count;
+  u64 max;
+  u64 buckets[BENCH_HIST_BUCKETS];
+} bench_hist;
+
+typedef struct {
+  void *ptr;
+  usize size;
+} bench_slot;
+
+typedef struct {
+  heap heap;
+  u64 rng;
+  usize ops;
+  usize budget;
+
+  usize requested;
+  usize reserved;
+  usize peak_requested;
+  usize peak_reserved;
+
+  bench_hist hist;
+  u64 elapsed;
+} bench;
+
+typedef struct {
+  cstr name;
+  void (*run)(bench *b);
+} bench_workload;
+
+static cstr bench_replay_path;
+
+/* Bench clock and histogram functions */
+
+static u64 bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Log-linear buckets, eight per power of two, the same layout HdrHistogram
+ * uses at its lowest precision. */
+static usize bench_hist_bucket(u64 v) {
+  usize e;
+
+  if (v < BENCH_HIST_SUB)
+    return v;
+
+  e = 63 - __builtin_clzll(v);
+  return (e - BENCH_HIST_SUB_BITS + 1) * BENCH_HIST_SUB +
+         ((v >> (e - BENCH_HIST_SUB_BITS)) & (BENCH_HIST_SUB - 1));
+}
+
+static u64 bench_hist_value(usize bucket) {
+  usize e = bucket / BENCH_HIST_SUB;
+  usize sub = bucket % BENCH_HIST_SUB;
+
+  if (e == 0)
+    return sub;
+
+  e += BENCH_HIST_SUB_BITS - 1;
+  return ((u64)1 << e) | ((u64)sub << (e - BENCH_HIST_SUB_BITS));
+}
+
+static void bench_hist_record(bench_hist *hist, u64 v) {
+  hist->count++;
+  hist->buckets[bench_hist_bucket(v)]++;
+  if (v > hist->max)
+    hist->max = v;
+}
+
+static u64 bench_hist_percentile(bench_hist *hist, usize permille) {
+  u64 want = (hist->count * permille + 999) / 1000;
+  u64 seen = 0;
+
+  for (usize i = 0; i < BENCH_HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= want && hist->buckets[i])
+      return bench_hist_value(i);
+  }
+
+  return hist->max;
+}
+
+static void bench_hist_print(bench_hist *hist) {
+  u64 most = 0;
+
+  for (usize i = 0; i < BENCH_HIST_BUCKETS; i++)
+    if (hist->buckets[i] > most)
+      most = hist->buckets[i];
+
+  for (usize i = 0; i < BENCH_HIST_BUCKETS; i++) {
+    int width;
+
+    if (!hist->buckets[i])
+      continue;
+
+    width = (int)(hist->buckets[i] * 50 / most);
+    printf("  %8llu ns %10llu |%.*s\n", (unsigned long long)bench_hist_value(i),
+           (unsigned long long)hist->buckets[i], width,
+           "##################################################");
+  }
+}
+
+/* Bench heap hooks */
+
+static void *bench_hook_alloc(void *ctx, usize size) {
+  bench *b = ctx;
+  void *ptr = aligned_alloc(HEAP_PAGE_SIZE, size);
+
+  if (!ptr)
+    return NULL;
+
+  b->reserved += size;
+  if (b->reserved > b->peak_reserved)
+    b->peak_reserved = b->reserved;
+  return ptr;
+}
+
+static void bench_hook_free(void *ctx, void *ptr, usize size) {
+  bench *b = ctx;
+
+  b->reserved -= size;
+  free(ptr);
+}
+
+static void bench_hook_log(void *ctx, enum HeapLogType type, cstr fmt,
+                           va_list args) {
+  (void)ctx;
+
+  if (type != HEAP_ERROR)
+    return;
+
+  fprintf(stderr, "heap: ");
+  vfprintf(stderr, fmt, args);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+/* Bench operations, every heap call goes through these so it is timed and
+ * accounted for. */
+
+static u64 bench_rand(bench *b) {
+  b->rng ^= b->rng << 13;
+  b->rng ^= b->rng >> 7;
+  b->rng ^= b->rng << 17;
+  return b->rng;
+}
+
+static usize bench_range(bench *b, usize lo, usize hi) {
+  return lo + bench_rand(b) % (hi - lo + 1);
+}
+
+/* Sizes with a density falling off as 1/size^2, mostly small blocks with a
+ * long tail up to 64K. */
+static usize bench_power_law(bench *b) {
+  usize shift = __builtin_ctzll(bench_rand(b) | (1ull << 12));
+  usize base = (usize)16 << shift;
+
+  return base + bench_rand(b) % base;
+}
+
+static void bench_touch(void *ptr, usize size) {
+  ((volatile u8 *)ptr)[0] = 0xb5;
+  ((volatile u8 *)ptr)[size - 1] = 0xb5;
+}
+
+static void bench_account(bench *b, usize from, usize to) {
+  b->requested += to - from;
+  if (b->requested > b->peak_requested)
+    b->peak_requested = b->requested;
+}
+
+static void *bench_alloc(bench *b, usize size) {
+  u64 start = bench_now();
+  void *ptr = heap_alloc(&b->heap, size);
+
+  bench_hist_record(&b->hist, bench_now() - start);
+  b->ops++;
+
+  if (!ptr) {
+    fprintf(stderr, "bench: out of memory allocating %zu bytes\n", size);
+    exit(1);
+  }
+
+  bench_touch(ptr, size);
+  bench_account(b, 0, size);
+  return ptr;
+}
+
+static void *bench_realloc(bench *b, void *ptr, usize old, usize size) {
+  u64 start = bench_now();
+
+  ptr = heap_realloc(&b->heap, ptr, size);
+  bench_hist_record(&b->hist, bench_now() - start);
+  b->ops++;
+
+  if (!ptr) {
+    fprintf(stderr, "bench: out of memory reallocating %zu bytes\n", size);
+    exit(1);
+  }
+
+  bench_touch(ptr, size);
+  bench_account(b, old, size);
+  return ptr;
+}
+
+static void bench_free(bench *b, void *ptr, usize size) {
+  u64 start = bench_now();
+
+  heap_free(&b->heap, ptr);
+  bench_hist_record(&b->hist, bench_now() - start);
+  b->ops++;
+
+  bench_account(b, size, 0);
+}
+
+static void bench_release(bench *b, bench_slot *slots, usize len) {
+  for (usize i = 0; i < len; i++)
+    if (slots[i].ptr)
+      heap_free(&b->heap, slots[i].ptr);
+}
+
+/* Bench workloads */
+
+static usize bench_size_small(bench *b) { return bench_range(b, 1, 256); }
+
+static void bench_slots(bench *b, usize (*size)(bench *b)) {
+  static bench_slot slots[BENCH_SLOTS];
+  bench_slot *slot;
+
+  memset(slots, 0, sizeof(slots));
+
+  while (b->ops < b->budget) {
+    slot = &slots[bench_rand(b) % BENCH_SLOTS];
+    if (slot->ptr) {
+      bench_free(b, slot->ptr, slot->size);
+      slot->ptr = NULL;
+    } else {
+      slot->size = size(b);
+      slot->ptr = bench_alloc(b, slot->size);
+    }
+  }
+
+  bench_release(b, slots, BENCH_SLOTS);
+}
+
+static void bench_uniform(bench *b) { bench_slots(b, bench_size_small); }
+
+static void bench_power(bench *b) { bench_slots(b, bench_power_law); }
+
+/* Bursts of allocations consumed in FIFO order, so lifetimes overlap the way
+ * they do for message buffers passed between two tasks. */
+static void bench_fifo(bench *b) {
+  static bench_slot queue[BENCH_QUEUE];
+  usize head = 0, tail = 0, burst;
+  bench_slot *slot;
+
+  while (b->ops < b->budget) {
+    burst = bench_range(b, 1, 64);
+    while (burst-- && tail - head < BENCH_QUEUE) {
+      slot = &queue[tail++ % BENCH_QUEUE];
+      slot->size = bench_range(b, 16, 2048);
+      slot->ptr = bench_alloc(b, slot->size);
+    }
+
+    burst = bench_range(b, 1, 64);
+    while (burst-- && head < tail) {
+      slot = &queue[head++ % BENCH_QUEUE];
+      bench_free(b, slot->ptr, slot->size);
+    }
+  }
+
+  while (head < tail) {
+    slot = &queue[head++ % BENCH_QUEUE];
+    heap_free(&b->heap, slot->ptr);
+  }
+}
+
+/* Vectors growing by half their size until they hit the cap, then dropped
+ * and started over. */
+static void bench_growth(bench *b) {
+  static bench_slot vectors[BENCH_VECTORS];
+  bench_slot *vec;
+  usize size;
+
+  memset(vectors, 0, sizeof(vectors));
+
+  while (b->ops < b->budget) {
+    vec = &vectors[bench_rand(b) % BENCH_VECTORS];
+    if (!vec->ptr) {
+      vec->size = 16;
+      vec->ptr = bench_alloc(b, vec->size);
+    } else if (vec->size >= BENCH_VECTOR_MAX) {
+      bench_free(b, vec->ptr, vec->size);
+      vec->ptr = NULL;
+    } else {
+      size = vec->size + vec->size / 2;
+      vec->ptr = bench_realloc(b, vec->ptr, vec->size, size);
+      vec->size = size;
+    }
+  }
+
+  bench_release(b, vectors, BENCH_VECTORS);
+}
+
+/* Replays a dump taken with heap_trace_read, pointers are mapped to slots
+ * through an open addressing table. Moved reallocs are traced as an alloc of
+ * the new block and a free of the old one, so only in place reallocs are
+ * replayed as reallocs. */
+static void bench_replay(bench *b) {
+  heap_event *events;
+  bench_slot *slots;
+  u64 *keys;
+  usize len, cap = 1, i, j;
+  FILE *f;
+  long end;
+
+  if (!bench_replay_path)
+    return;
+
+  f = fopen(bench_replay_path, "rb");
+  if (!f) {
+    perror(bench_replay_path);
+    exit(1);
+  }
+
+  fseek(f, 0, SEEK_END);
+  end = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  len = (usize)end / sizeof(heap_event);
+
+  events = malloc(len * sizeof(heap_event) + 1);
+  if (fread(events, sizeof(heap_event), len, f) != len) {
+    perror(bench_replay_path);
+    exit(1);
+  }
+  fclose(f);
+
+  while (cap < len * 2)
+    cap <<= 1;
+  keys = calloc(cap, sizeof(u64));
+  slots = calloc(cap, sizeof(bench_slot));
+
+  for (i = 0; i < len && b->ops < b->budget; i++) {
+    heap_event *ev = &events[i];
+
+    if (ev->op != HEAP_OP_ALLOC && ev->op != HEAP_OP_FREE &&
+        ev->op != HEAP_OP_REALLOC)
+      continue;
+
+    if (ev->op == HEAP_OP_REALLOC && !ev->major)
+      continue;
+
+    for (j = (ev->ptr >> 4) & (cap - 1); keys[j] && keys[j] != ev->ptr;
+         j = (j + 1) & (cap - 1))
+      ;
+
+    switch (ev->op) {
+    case HEAP_OP_ALLOC:
+      if (slots[j].ptr)
+        bench_free(b, slots[j].ptr, slots[j].size);
+      keys[j] = ev->ptr;
+      slots[j].size = ev->size;
+      slots[j].ptr = bench_alloc(b, ev->size);
+      break;
+
+    case HEAP_OP_FREE:
+      if (!slots[j].ptr)
+        break;
+      bench_free(b, slots[j].ptr, slots[j].size);
+      slots[j].ptr = NULL;
+      break;
+
+    case HEAP_OP_REALLOC:
+      if (!slots[j].ptr)
+        break;
+      slots[j].ptr = bench_realloc(b, slots[j].ptr, slots[j].size, ev->size);
+      slots[j].size = ev->size;
+      break;
+    }
+  }
+
+  bench_release(b, slots, cap);
+  free(slots);
+  free(keys);
+  free(events);
+}
+
+static bench_workload bench_workloads[] = {
+    {"uniform", bench_uniform}, {"power-law", bench_power},
+    {"fifo", bench_fifo},       {"growth", bench_growth},
+    {"replay", bench_replay},
+};
+
+/* Bench driver */
+
+static void bench_report(bench_workload *w, bench *b, bool csv) {
+  double secs = (double)b->elapsed / 1e9;
+  double ratio = b->peak_requested
+                     ? (double)b->peak_reserved / (double)b->peak_requested
+                     : 0;
+
+  if (csv) {
+    printf("%s,%zu,%.0f,%llu,%llu,%llu,%zu,%zu,%.3f\n", w->name, b->ops,
+           b->ops / secs,
+           (unsigned long long)bench_hist_percentile(&b->hist, 500),
+           (unsigned long long)bench_hist_percentile(&b->hist, 990),
+           (unsigned long long)b->hist.max, b->peak_requested,
+           b->peak_reserved, ratio);
+    return;
+  }
+
+  printf("%-10s %10zu %12.0f %8llu %8llu %10llu %12zu %12zu %8.3f\n", w->name,
+         b->ops, b->ops / secs,
+         (unsigned long long)bench_hist_percentile(&b->hist, 500),
+         (unsigned long long)bench_hist_percentile(&b->hist, 990),
+         (unsigned long long)b->hist.max, b->peak_requested, b->peak_reserved,
+         ratio);
+}
+
+static void bench_run(bench_workload *w, usize budget, u64 seed, bool csv,
+                      bool hist) {
+  static bench b;
+  u64 start;
+
+  memset(&b, 0, sizeof(b));
+  b.rng = seed ? seed : 1;
+  b.budget = budget;
+  b.heap = (heap){
+      .ctx = &b,
+      .alloc = bench_hook_alloc,
+      .free = bench_hook_free,
+      .log = bench_hook_log,
+  };
+
+  start = bench_now();
+  w->run(&b);
+  b.elapsed = bench_now() - start;
+
+  heap_trim(&b.heap);
+  if (b.reserved)
+    fprintf(stderr, "bench: %s leaked %zu reserved bytes\n", w->name,
+            b.reserved);
+
+  if (!b.ops)
+    return;
+
+  bench_report(w, &b, csv);
+  if (hist && !csv)
+    bench_hist_print(&b.hist);
+}
+
+static void bench_usage(cstr self) {
+  fprintf(stderr,
+          "usage: %s [-n ops] [-s seed] [-w workload] [-r dump] [-c] [-H]\n"
+          "  -n ops       operations per workload (default 1000000)\n"
+          "  -s seed      random seed\n"
+          "  -w workload  uniform, power-law, fifo, growth or replay\n"
+          "  -r dump      heap trace dump to replay\n"
+          "  -c           print results as csv\n"
+          "  -H           print latency histograms\n",
+          self);
+}
+
+int main(int argc, char **argv) {
+  usize budget = 1000000;
+  u64 seed = 0x9e3779b97f4a7c15;
+  cstr only = NULL;
+  bool csv = false, hist = false;
+  usize ran = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:s:w:r:cH")) != -1) {
+    switch (opt) {
+    case 'n':
+      budget = strtoull(optarg, NULL, 0);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 0);
+      break;
+    case 'w':
+      only = optarg;
+      break;
+    case 'r':
+      bench_replay_path = optarg;
+      break;
+    case 'c':
+      csv = true;
+      break;
+    case 'H':
+      hist = true;
+      break;
+    default:
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (only && strcmp(only, "replay") == 0 && !bench_replay_path) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  if (csv)
+    printf("workload,ops,ops_per_sec,p50_ns,p99_ns,max_ns,peak_requested,"
+           "peak_reserved,reserved_ratio\n");
+  else
+    printf("%-10s %10s %12s %8s %8s %10s %12s %12s %8s\n", "workload", "ops",
+           "ops/s", "p50 ns", "p99 ns", "max ns", "peak req", "peak res",
+           "ratio");
+
+  for (usize i = 0; i < sizeof(bench_workloads) / sizeof(*bench_workloads);
+       i++) {
+    if (only && strcmp(only, bench_workloads[i].name) != 0)
+      continue;
+
+    bench_run(&bench_workloads[i], budget, seed, csv, hist);
+    ran++;
+  }
+
+  if (!ran) {
+    fprintf(stderr, "bench: unknown workload '%s'\n", only);
+    return 1;
+  }
+
+  return 0;
+}
@@ -7,11 +7,17 @@
 // https://github.com/riscv-software-src/opensbi/blob/master/docs/firmware/fw.md
 // https://github.com/riscv-non-isa/riscv-sbi-doc
 
+#include <fdt/fdt.h>
 #include <p5k-base/base.h>
+#include <p5k-base/heap.h>
+#include <p5k-ring/ring.h>
 #include <riscv/riscv.h>
 #include <sbi/sbi.h>
 
 extern sym __kernel_start, __kernel_end;
+extern sym __text_start, __text_end;
+extern sym __rodata_start, __rodata_end;
+extern sym __data_start, __data_end;
 extern sym __bss_start, __bss_end;
 
 /* --- Kernel Base ---------------------------------------------------------- */
@@ -40,67 +46,3533 @@ void p5k_log(str fmt, ...) {
 
 void p5K_unreachable(void) { p5k_panic(_s("unreachable")); }
 
+typedef struct {
+  atomic_flag flag;
+} p5k_lock;
+
+void p5k_lock_acquire(p5k_lock *lock) {
+  while (atomic_flag_test_and_set_explicit(&lock->flag, memory_order_acquire))
+    ;
+}
+
+bool p5k_lock_try(p5k_lock *lock) {
+  return !atomic_flag_test_and_set_explicit(&lock->flag, memory_order_acquire);
+}
+
+void p5k_lock_release(p5k_lock *lock) {
+  atomic_flag_clear_explicit(&lock->flag, memory_order_release);
+}
+
 /* --- Trap Handling -------------------------------------------------------- */
 
+/* Must match the layout used by _p5k_trap in kernel.s. The fast path only
+ * fills the caller-saved registers, tp, sp and sepc. */
 typedef struct {
   usize ra, gp, tp, t0, t1, t2, t3, t4, t5, t6, a0, a1, a2, a3, a4, a5, a6, a7,
       s0, s1, s2, s3, s4, s5, s6, s7, s8, s9, s10, s11, sp;
+  usize sepc, sstatus;
 } __attribute__((packed)) p5k_frame;
 
+_Static_assert(sizeof(p5k_frame) == 33 * sizeof(usize), "p5k_frame layout");
+
+/* Stack space the trap path reserves for a frame, padded for alignment. */
+#define P5K_FRAME_SIZE (36 * sizeof(usize))
+
+#define P5K_TRAP_EXCEPTIONS (16)
+#define P5K_TRAP_CAUSES (32)
+
+/* Fast handlers run with a partial frame and return true to take the full
+ * path through p5k_trap_switch, e.g. to switch tasks. */
+typedef bool (*p5k_trap_fn)(p5k_frame *frame);
+
+p5k_trap_fn p5k_trap_table[P5K_TRAP_CAUSES];
+
+void p5k_trap_register(usize cause, p5k_trap_fn fn) {
+  if (cause & RISCV_CAUSE_INTERRUPT)
+    cause = (cause & ~RISCV_CAUSE_INTERRUPT) + P5K_TRAP_EXCEPTIONS;
+
+  if (cause >= P5K_TRAP_CAUSES)
+    p5k_panic(_s("trap: cause %x out of range"), cause);
+
+  p5k_trap_table[cause] = fn;
+}
+
+bool p5k_fault(usize addr, usize cause);
+bool p5k_task_fault(void);
+p5k_frame *p5k_trap_switch(p5k_frame *frame);
+
 extern void _p5k_trap(void);
-void p5k_trap(p5k_frame *) {
+
+/* Full path for causes without a fast handler, faults mostly. A task whose
+ * trap cannot be resolved is killed, only the kernel's own panic. */
+p5k_frame *p5k_trap(p5k_frame *frame) {
   let scause = riscv_csrr(scause);
   let stval = riscv_csrr(stval);
-  let sepc = riscv_csrr(sepc);
 
-  p5k_panic(_s("trap: scause=%x, stval=%x, sepc=%x"), scause, stval, sepc);
+  if (p5k_fault(stval, scause))
+    return frame;
+
+  if (frame->sstatus & RISCV_SSTATUS_SPP)
+    p5k_panic(_s("trap: scause=%x, stval=%x, sepc=%x"), scause, stval,
+              frame->sepc);
+
+  p5k_log(_s("trap: scause=%x, stval=%x, sepc=%x"), scause, stval,
+          frame->sepc);
+  p5k_task_fault();
+  return p5k_trap_switch(frame);
 }
 
-/* --- Kernel Object -------------------------------------------------------- */
+p5k_frame *p5k_sched_switch(p5k_frame *frame);
+
+/* Full path taken on request of a fast handler, returns the frame to resume
+ * which is where the scheduler gets to pick another task. The trap bench
+ * swaps the scheduler out to time the path on its own. */
+static p5k_frame *(*p5k_trap_switch_fn)(p5k_frame *frame) = p5k_sched_switch;
+
+p5k_frame *p5k_trap_switch(p5k_frame *frame) {
+  return p5k_trap_switch_fn(frame);
+}
+
+p5k_frame *p5k_trap_bench_resume(p5k_frame *frame) { return frame; }
+
+static bool p5k_trap_bench_full;
+
+bool p5k_trap_bench_breakpoint(p5k_frame *frame) {
+  frame->sepc += 4;
+  return p5k_trap_bench_full;
+}
+
+/* Measures the trap round trip with a self-inflicted ebreak: the fast path,
+ * the full path resuming the same frame, which is what every trap cost
+ * before the fast path, and the full path through the scheduler with
+ * nothing else to run. */
+void p5k_trap_bench(void) {
+  usize const rounds = 1000;
+  usize cycles[3];
+
+  p5k_trap_register(RISCV_EXC_BREAKPOINT, p5k_trap_bench_breakpoint);
+
+  for (usize mode = 0; mode < 3; mode++) {
+    p5k_trap_bench_full = mode > 0;
+    p5k_trap_switch_fn =
+        mode == 1 ? p5k_trap_bench_resume : p5k_sched_switch;
+
+    let start = riscv_csrr(cycle);
+    for (usize i = 0; i < rounds; i++)
+      __asm__ __volatile__(".option push\n"
+                           ".option norvc\n"
+                           "ebreak\n"
+                           ".option pop\n" ::
+                               : "memory");
+    cycles[mode] = (riscv_csrr(cycle) - start) / rounds;
+  }
+
+  p5k_trap_switch_fn = p5k_sched_switch;
+  p5k_trap_register(RISCV_EXC_BREAKPOINT, nil);
+  p5k_log(_s("trap: round trip fast=%d full=%d sched=%d cycles"), cycles[0],
+          cycles[1], cycles[2]);
+}
+
+/* --- Harts ---------------------------------------------------------------- */
+
+#define P5K_HART_MAX (32)
+#define P5K_CACHE_LINE (64)
+#define P5K_PAGE_CACHE (16)
+
+enum {
+  P5K_HART_SSTC = 1 << 0,
+  P5K_HART_FPU = 1 << 1,
+  P5K_HART_VECTOR = 1 << 2,
+};
+
+/* Each hart's own control block, which tp points at while in the kernel. A
+ * block is only written by its hart, asid_flush aside, and fills whole cache
+ * lines so neighbours never share one. */
+typedef struct p5k_hart {
+  /* Used by _p5k_trap and _p5k_hart_entry in kernel.s, keep in sync. */
+  _Alignas(P5K_CACHE_LINE) usize kstack;
+  usize scratch;
+  usize stack;
+
+  usize index;
+  usize hartid;
+
+  struct p5k_space *space;
+  _Atomic bool asid_flush;
+  struct p5k_ext *ext, *fpu_owner, *vec_owner;
+
+  void *pages[P5K_PAGE_CACHE];
+  usize cached;
+  heap_cache heap;
+
+  usize switches, steals;
+} p5k_hart;
+
+_Static_assert(offsetof(p5k_hart, kstack) == 0 * sizeof(usize) &&
+                   offsetof(p5k_hart, scratch) == 1 * sizeof(usize) &&
+                   offsetof(p5k_hart, stack) == 2 * sizeof(usize),
+               "p5k_hart layout");
+
+static p5k_hart p5k_hart_blocks[P5K_HART_MAX];
+
+/* Features are only used when every hart has them. Online is the mask of
+ * hart indices that made it through p5k_hart_setup. */
+static struct {
+  usize count;
+  u32 freq;
+  u32 features;
+  _Atomic u32 online;
+} p5k_harts;
+
+p5k_hart *p5k_hart_cpu(void) {
+  p5k_hart *hart;
+  __asm__ __volatile__("mv %0, tp" : "=r"(hart));
+  return hart;
+}
+
+/* Dense index of the calling hart. */
+usize p5k_hart_self(void) { return p5k_hart_cpu()->index; }
+
+void p5k_hart_bind(p5k_hart *hart) {
+  __asm__ __volatile__("mv tp, %0" ::"r"(hart) : "memory");
+}
+
+/* Matches ext against the extensions of a riscv,isa string or the entries of
+ * a riscv,isa-extensions list. Single letters are also looked up in the
+ * rv32... base, where g stands for imafd. */
+bool p5k_isa_has(bytes isa, cstr ext) {
+  usize start = 0;
+
+  for (usize i = 0; i <= isa.len; i++) {
+    if (i < isa.len && isa.buf[i] != '_' && isa.buf[i])
+      continue;
+
+    usize j = 0;
+    while (start + j < i && ext[j] && (isa.buf[start + j] | 0x20) == ext[j])
+      j++;
+    if (!ext[j] && start + j == i)
+      return true;
+
+    if (!ext[1] && i - start > 4 && (isa.buf[start] | 0x20) == 'r' &&
+        (isa.buf[start + 1] | 0x20) == 'v') {
+      for (usize k = start + 4; k < i; k++) {
+        u8 c = isa.buf[k] | 0x20;
+        if (c == (u8)ext[0])
+          return true;
+        for (cstr g = "imafd"; c == 'g' && *g; g++)
+          if (*g == ext[0])
+            return true;
+      }
+    }
+
+    start = i + 1;
+  }
+
+  return false;
+}
+
+u32 p5k_isa_features(bytes isa) {
+  u32 features = 0;
+
+  if (p5k_isa_has(isa, "sstc"))
+    features |= P5K_HART_SSTC;
+  if (p5k_isa_has(isa, "d"))
+    features |= P5K_HART_FPU;
+  if (p5k_isa_has(isa, "v"))
+    features |= P5K_HART_VECTOR;
+
+  return features;
+}
 
 typedef struct {
-} p5k_vmo;
+  bool cpus, cpu, disabled;
+  u32 features, cpu_features;
+  u32 addr_cells;
+  u64 hartid;
+  usize harts;
+  usize hartids[P5K_HART_MAX];
+  u32 freq;
+} p5k_cpuscan;
+
+/* Picks up timebase-frequency from /cpus or a cpu node, and the hartid and
+ * extensions of each cpu node that is not disabled. */
+res p5k_cpuscan_visit(void *ctx, usize depth, fdt_tok tok ref) {
+  p5k_cpuscan *scan = ctx;
+
+  switch (tok->type) {
+  case FDT_BEGIN_NODE:
+    if (depth == 1) {
+      scan->cpus = fdt_name_is(tok->name, "cpus");
+      scan->addr_cells = 1;
+    }
+    if (depth == 2 && scan->cpus) {
+      scan->cpu = fdt_name_is(tok->name, "cpu");
+      scan->cpu_features = 0;
+      scan->disabled = false;
+      scan->hartid = (u64)-1;
+    }
+    break;
+
+  case FDT_PROP:
+    if (!scan->cpus)
+      break;
+    if ((depth == 2 || (depth == 3 && scan->cpu)) &&
+        fdt_prop_is(tok, "timebase-frequency")) {
+      scan->freq = fdt_prop_u32(tok);
+    } else if (depth == 2 && fdt_prop_is(tok, "#address-cells")) {
+      scan->addr_cells = fdt_prop_u32(tok);
+    } else if (depth == 3 && scan->cpu && fdt_prop_is(tok, "reg")) {
+      var c = cursor_make(tok->value);
+      try(fdt_cells(&c, scan->addr_cells, &scan->hartid));
+    } else if (depth == 3 && scan->cpu && fdt_prop_is(tok, "status")) {
+      str status = {cstr_nlen((cstr)tok->value.buf, tok->value.len),
+                    tok->value.buf};
+      scan->disabled =
+          !fdt_name_is(status, "okay") && !fdt_name_is(status, "ok");
+    } else if (depth == 3 && scan->cpu &&
+               (fdt_prop_is(tok, "riscv,isa") ||
+                fdt_prop_is(tok, "riscv,isa-extensions"))) {
+      scan->cpu_features |= p5k_isa_features(tok->value);
+    }
+    break;
+
+  case FDT_END_NODE:
+    if (depth == 2 && scan->cpu && !scan->disabled &&
+        scan->hartid != (u64)-1 && scan->harts < P5K_HART_MAX) {
+      scan->features &= scan->cpu_features;
+      scan->hartids[scan->harts++] = scan->hartid;
+    }
+    if (depth == 2)
+      scan->cpu = false;
+    if (depth == 1)
+      scan->cpus = false;
+    break;
+
+  default:
+    break;
+  }
+
+  return ok();
+}
+
+/* Numbers the harts densely with the boot hart first, the others are started
+ * once the kernel is set up by p5k_harts_start. */
+void p5k_harts_init(struct fdt f ref, usize boot) {
+  p5k_cpuscan scan = {.features = (u32)-1};
+
+  if (fdt_walk(f, p5k_cpuscan_visit, &scan).type != RES_OK)
+    p5k_panic(_s("harts: malformed device tree"));
+
+  usize i = 0;
+  while (i < scan.harts && scan.hartids[i] != boot)
+    i++;
+  if (i == scan.harts)
+    p5k_panic(_s("harts: boot hart %d not in the device tree"), boot);
+
+  scan.hartids[i] = scan.hartids[0];
+  scan.hartids[0] = boot;
+
+  p5k_harts.count = scan.harts;
+  p5k_harts.freq = scan.freq;
+  p5k_harts.features = scan.features;
+
+  for (i = 0; i < scan.harts; i++) {
+    p5k_hart_blocks[i].index = i;
+    p5k_hart_blocks[i].hartid = scan.hartids[i];
+  }
+
+  p5k_log(_s("harts: %d, features %x"), p5k_harts.count, p5k_harts.features);
+}
+
+bool p5k_hart_has(u32 feature) { return (p5k_harts.features & feature) != 0; }
+
+/* SBI takes hart masks in hartids, a window of XLEN of them from a base. Takes
+ * the harts of one window off a mask of hart indices and returns the window,
+ * callers loop until the mask is empty. */
+usize p5k_harts_window(u32 *mask, usize *base) {
+  usize window = 0;
+
+  *base = (usize)-1;
+  for (u32 m = *mask; m; m &= m - 1) {
+    let hartid = p5k_hart_blocks[__builtin_ctz(m)].hartid;
+    *base = hartid < *base ? hartid : *base;
+  }
+
+  for (u32 m = *mask; m; m &= m - 1) {
+    let i = __builtin_ctz(m);
+    let hartid = p5k_hart_blocks[i].hartid;
+    if (hartid - *base < sizeof(usize) * 8) {
+      window |= (usize)1 << (hartid - *base);
+      *mask &= ~((u32)1 << i);
+    }
+  }
+
+  return window;
+}
+
+/* Raises a supervisor software interrupt on every hart in mask. */
+void p5k_harts_ipi(u32 mask) {
+  while (mask) {
+    usize base;
+    let window = p5k_harts_window(&mask, &base);
+    sbi_send_ipi(window, base);
+  }
+}
+
+/* --- Physical Memory ------------------------------------------------------ */
+
+#define P5K_PAGE_SIZE (4096)
+#define P5K_PAGE_SHIFT (12)
+/* Order 10 blocks are 4MiB, the size of an Sv32 megapage. */
+#define P5K_PMM_ORDERS (11)
+#define P5K_PMM_RANGES (16)
+#define P5K_FDT_DEPTH (8)
+
+#define P5K_PMM_BLOCK(order) ((usize)P5K_PAGE_SIZE << (order))
+#define P5K_PMM_MAX_BLOCK P5K_PMM_BLOCK(P5K_PMM_ORDERS - 1)
 
 typedef struct {
-} p5k_space;
+  usize base, end;
+} p5k_range;
 
+typedef struct p5k_block {
+  struct p5k_block *prev, *next;
+} p5k_block;
+
+/* Buddy allocator over [base, end). A block of a given order is free when it
+ * is on that order's free list, which is mirrored by one bit per block in
+ * that order's bitmap so finding out if a buddy can be merged is O(1). The
+ * lists are shared by all harts under the lock, single pages mostly come
+ * from a cache in each hart's block instead. */
 typedef struct {
-} p5k_task;
+  usize base, end;
+  usize pages, free;
+  p5k_block *lists[P5K_PMM_ORDERS];
+  u32 *bitmaps[P5K_PMM_ORDERS];
+  _Atomic u16 *refs;
+  p5k_lock lock;
+} p5k_pmm;
+
+static p5k_pmm pmm;
+
+usize p5k_pmm_index(usize addr, usize order) {
+  return (addr - pmm.base) >> (P5K_PAGE_SHIFT + order);
+}
+
+bool p5k_pmm_test(usize addr, usize order) {
+  let i = p5k_pmm_index(addr, order);
+  return pmm.bitmaps[order][i / 32] & (1u << (i % 32));
+}
+
+void p5k_pmm_push(usize addr, usize order) {
+  let i = p5k_pmm_index(addr, order);
+  p5k_block *block = (p5k_block *)addr;
+
+  block->prev = nil;
+  block->next = pmm.lists[order];
+  if (block->next)
+    block->next->prev = block;
+  pmm.lists[order] = block;
+  pmm.bitmaps[order][i / 32] |= 1u << (i % 32);
+}
+
+void p5k_pmm_unlink(usize addr, usize order) {
+  let i = p5k_pmm_index(addr, order);
+  p5k_block *block = (p5k_block *)addr;
+
+  if (block->prev)
+    block->prev->next = block->next;
+  else
+    pmm.lists[order] = block->next;
+  if (block->next)
+    block->next->prev = block->prev;
+  pmm.bitmaps[order][i / 32] &= ~(1u << (i % 32));
+}
+
+void p5k_pmm_release(usize addr, usize order) {
+  while (order < P5K_PMM_ORDERS - 1) {
+    let buddy = ((addr - pmm.base) ^ P5K_PMM_BLOCK(order)) + pmm.base;
+    if (buddy + P5K_PMM_BLOCK(order) > pmm.end || !p5k_pmm_test(buddy, order))
+      break;
+
+    p5k_pmm_unlink(buddy, order);
+    addr = addr < buddy ? addr : buddy;
+    order++;
+  }
+
+  p5k_pmm_push(addr, order);
+}
+
+usize p5k_pmm_order(usize pages) {
+  usize order = 0;
+  while (((usize)1 << order) < pages)
+    order++;
+  return order;
+}
+
+/* Callers of the unlocked variants hold pmm.lock. */
+void *p5k_pmm_take(usize order) {
+  usize found = order;
+
+  while (found < P5K_PMM_ORDERS && !pmm.lists[found])
+    found++;
+
+  if (found >= P5K_PMM_ORDERS)
+    return nil;
+
+  let addr = (usize)pmm.lists[found];
+  p5k_pmm_unlink(addr, found);
+
+  while (found > order) {
+    found--;
+    p5k_pmm_push(addr + P5K_PMM_BLOCK(found), found);
+  }
+
+  pmm.free -= (usize)1 << order;
+  return (void *)addr;
+}
+
+void p5k_pmm_give(void *ptr, usize order) {
+  pmm.free += (usize)1 << order;
+  p5k_pmm_release((usize)ptr, order);
+}
+
+/* Single pages go through the hart's cache, which is refilled and drained
+ * half at a time so a hart bouncing around the edge takes the lock once per
+ * P5K_PAGE_CACHE / 2 pages. */
+void *p5k_pmm_alloc(usize order) {
+  var hart = p5k_hart_cpu();
+
+  if (order || !hart->cached) {
+    p5k_lock_acquire(&pmm.lock);
+    void *ptr = p5k_pmm_take(order);
+    while (!order && ptr && hart->cached < P5K_PAGE_CACHE / 2) {
+      hart->pages[hart->cached++] = ptr;
+      ptr = p5k_pmm_take(0);
+    }
+    p5k_lock_release(&pmm.lock);
+
+    if (order || ptr || !hart->cached)
+      return ptr;
+  }
+
+  return hart->pages[--hart->cached];
+}
+
+void p5k_pmm_free(void *ptr, usize order) {
+  var hart = p5k_hart_cpu();
+
+  if (!order && hart->cached < P5K_PAGE_CACHE) {
+    hart->pages[hart->cached++] = ptr;
+    return;
+  }
+
+  p5k_lock_acquire(&pmm.lock);
+  p5k_pmm_give(ptr, order);
+  while (!order && hart->cached > P5K_PAGE_CACHE / 2)
+    p5k_pmm_give(hart->pages[--hart->cached], 0);
+  p5k_lock_release(&pmm.lock);
+}
+
+/* Frees a page aligned range as the largest blocks its alignment allows. */
+void p5k_pmm_free_range(usize base, usize end) {
+  while (base < end) {
+    usize order = P5K_PMM_ORDERS - 1;
+    while (((base - pmm.base) & (P5K_PMM_BLOCK(order) - 1)) ||
+           base + P5K_PMM_BLOCK(order) > end)
+      order--;
+
+    p5k_pmm_give((void *)base, order);
+    base += P5K_PMM_BLOCK(order);
+  }
+}
+
+/* Allocates exactly pages contiguous pages, the tail of the rounded up block
+ * goes straight back to the free lists. */
+void *p5k_pmm_alloc_pages(usize pages) {
+  let order = p5k_pmm_order(pages);
+  if (order >= P5K_PMM_ORDERS)
+    return nil;
+
+  p5k_lock_acquire(&pmm.lock);
+  let ptr = p5k_pmm_take(order);
+  if (ptr)
+    p5k_pmm_free_range((usize)ptr + pages * P5K_PAGE_SIZE,
+                       (usize)ptr + P5K_PMM_BLOCK(order));
+  p5k_lock_release(&pmm.lock);
+  return ptr;
+}
+
+void p5k_pmm_free_pages(void *ptr, usize pages) {
+  p5k_lock_acquire(&pmm.lock);
+  p5k_pmm_free_range((usize)ptr, (usize)ptr + pages * P5K_PAGE_SIZE);
+  p5k_lock_release(&pmm.lock);
+}
+
+/* Frames are refcounted pages, shared between VMOs by copy-on-write. */
+usize p5k_frame_alloc(bool zero) {
+  void *page = p5k_pmm_alloc(0);
+  if (!page)
+    return 0;
+
+  if (zero)
+    mem_zero((bytes){P5K_PAGE_SIZE, page});
+  atomic_store_explicit(&pmm.refs[p5k_pmm_index((usize)page, 0)], 1,
+                        memory_order_relaxed);
+  return (usize)page;
+}
+
+usize p5k_frame_refs(usize frame) {
+  return atomic_load_explicit(&pmm.refs[p5k_pmm_index(frame, 0)],
+                              memory_order_acquire);
+}
+
+void p5k_frame_ref(usize frame) {
+  atomic_fetch_add_explicit(&pmm.refs[p5k_pmm_index(frame, 0)], 1,
+                            memory_order_relaxed);
+}
+
+void p5k_frame_deref(usize frame) {
+  if (atomic_fetch_sub_explicit(&pmm.refs[p5k_pmm_index(frame, 0)], 1,
+                                memory_order_acq_rel) == 1)
+    p5k_pmm_free((void *)frame, 0);
+}
+
+usize p5k_range_add(p5k_range *ranges, usize len, u64 addr, u64 size) {
+  let limit = (u64)(usize)-1;
+
+  if (!size || addr >= limit)
+    return len;
+
+  if (len >= P5K_PMM_RANGES)
+    p5k_panic(_s("pmm: too many memory ranges"));
+
+  ranges[len] = (p5k_range){
+      .base = addr,
+      .end = size > limit - addr ? limit : addr + size,
+  };
+  return len + 1;
+}
+
+usize p5k_range_sub(p5k_range *ranges, usize len, p5k_range rsv) {
+  for (usize i = 0; i < len; i++) {
+    var r = &ranges[i];
+
+    if (rsv.end <= r->base || rsv.base >= r->end)
+      continue;
+
+    if (rsv.base > r->base && rsv.end < r->end) {
+      len = p5k_range_add(ranges, len, rsv.end, r->end - rsv.end);
+      r->end = rsv.base;
+    } else if (rsv.base > r->base) {
+      r->end = rsv.base;
+    } else if (rsv.end < r->end) {
+      r->base = rsv.end;
+    } else {
+      ranges[i--] = ranges[--len];
+    }
+  }
+
+  return len;
+}
 
 typedef struct {
-  usize id;
+  u32 addr_cells[P5K_FDT_DEPTH];
+  u32 size_cells[P5K_FDT_DEPTH];
+  bool memory, reserved;
+  bytes reg;
 
-  enum p5k_type {
-    P5K_TYPE_NONE,
-    P5K_TYPE_TASK,
-    P5K_TYPE_SPACE,
-    P5K_TYPE_VMO,
-  } type;
+  p5k_range ram[P5K_PMM_RANGES];
+  usize ram_len;
+  p5k_range rsv[P5K_PMM_RANGES];
+  usize rsv_len;
+} p5k_memscan;
+
+res p5k_memscan_reg(p5k_memscan *scan, usize depth, bytes reg, bool ram) {
+  let ac = scan->addr_cells[depth - 1];
+  let sc = scan->size_cells[depth - 1];
+  var c = cursor_make(reg);
+  u64 addr, size;
+
+  while (cursor_rem(&c) >= (ac + sc) * 4) {
+    try(fdt_cells(&c, ac, &addr));
+    try(fdt_cells(&c, sc, &size));
+
+    if (ram)
+      scan->ram_len = p5k_range_add(scan->ram, scan->ram_len, addr, size);
+    else
+      scan->rsv_len = p5k_range_add(scan->rsv, scan->rsv_len, addr, size);
+  }
+
+  return ok();
+}
+
+/* Collects /memory nodes and the children of /reserved-memory, which is
+ * where OpenSBI describes the memory it protects with PMP. */
+res p5k_memscan_visit(void *ctx, usize depth, fdt_tok tok ref) {
+  p5k_memscan *scan = ctx;
+
+  if (depth + 1 >= P5K_FDT_DEPTH)
+    return ok();
+
+  switch (tok->type) {
+  case FDT_BEGIN_NODE:
+    scan->addr_cells[depth + 1] = 2;
+    scan->size_cells[depth + 1] = 1;
+    if (depth == 1) {
+      scan->memory = fdt_name_is(tok->name, "memory");
+      scan->reserved = fdt_name_is(tok->name, "reserved-memory");
+      scan->reg = (bytes){0, nil};
+    }
+    break;
+
+  case FDT_PROP:
+    if (fdt_prop_is(tok, "#address-cells"))
+      scan->addr_cells[depth] = fdt_prop_u32(tok);
+    else if (fdt_prop_is(tok, "#size-cells"))
+      scan->size_cells[depth] = fdt_prop_u32(tok);
+    else if (depth == 2 && fdt_prop_is(tok, "device_type"))
+      scan->memory |=
+          fdt_name_is((str){cstr_nlen((cstr)tok->value.buf, tok->value.len),
+                            tok->value.buf},
+                      "memory");
+    else if (depth == 2 && fdt_prop_is(tok, "reg"))
+      scan->reg = tok->value;
+    else if (depth == 3 && scan->reserved && fdt_prop_is(tok, "reg"))
+      try(p5k_memscan_reg(scan, depth, tok->value, false));
+    break;
+
+  case FDT_END_NODE:
+    if (depth == 1 && scan->memory)
+      try(p5k_memscan_reg(scan, 2, scan->reg, true));
+    if (depth == 1)
+      scan->memory = scan->reserved = false;
+    break;
+
+  default:
+    break;
+  }
+
+  return ok();
+}
+
+usize p5k_align_up(usize v, usize align) {
+  return (v + align - 1) & ~(align - 1);
+}
+
+usize p5k_align_down(usize v, usize align) { return v & ~(align - 1); }
+
+void p5k_pmm_init(struct fdt f ref) {
+  p5k_memscan scan = {};
+  fdt_range entry;
+  usize bitmap_size = 0;
+
+  scan.addr_cells[1] = 2;
+  scan.size_cells[1] = 1;
+
+  if (fdt_walk(f, p5k_memscan_visit, &scan).type != RES_OK)
+    p5k_panic(_s("pmm: malformed device tree"));
+
+  for (usize i = 0; fdt_rsvmap(f, i, &entry).type == RES_OK; i++)
+    scan.rsv_len =
+        p5k_range_add(scan.rsv, scan.rsv_len, entry.addr, entry.size);
+
+  scan.rsv_len = p5k_range_add(scan.rsv, scan.rsv_len, (usize)__kernel_start,
+                               __kernel_end - __kernel_start);
+  scan.rsv_len = p5k_range_add(scan.rsv, scan.rsv_len, (usize)f->blob.buf,
+                               f->blob.len);
+
+  for (usize i = 0; i < scan.rsv_len; i++)
+    scan.ram_len = p5k_range_sub(scan.ram, scan.ram_len, scan.rsv[i]);
+
+  pmm.base = (usize)-1;
+  for (usize i = 0; i < scan.ram_len; i++) {
+    var r = &scan.ram[i];
+    r->base = p5k_align_up(r->base, P5K_PAGE_SIZE);
+    r->end = p5k_align_down(r->end, P5K_PAGE_SIZE);
+    if (r->base >= r->end) {
+      scan.ram[i--] = scan.ram[--scan.ram_len];
+      continue;
+    }
+
+    pmm.base = r->base < pmm.base ? r->base : pmm.base;
+    pmm.end = r->end > pmm.end ? r->end : pmm.end;
+  }
+
+  if (!scan.ram_len)
+    p5k_panic(_s("pmm: no usable memory"));
+
+  /* Blocks are aligned relative to base, aligning it to the largest block
+   * keeps them naturally aligned in physical memory too. */
+  pmm.base = p5k_align_down(pmm.base, P5K_PMM_MAX_BLOCK);
+  pmm.pages = (pmm.end - pmm.base) >> P5K_PAGE_SHIFT;
+
+  for (usize order = 0; order < P5K_PMM_ORDERS; order++)
+    bitmap_size += ((pmm.pages >> order) / 32 + 1) * sizeof(u32);
+  bitmap_size += pmm.pages * sizeof(*pmm.refs);
+  bitmap_size = p5k_align_up(bitmap_size, P5K_PAGE_SIZE);
+
+  /* The bitmaps and frame refcounts live in the first range that fits
+   * them. */
+  for (usize i = 0; i <= scan.ram_len; i++) {
+    if (i == scan.ram_len)
+      p5k_panic(_s("pmm: no room for the page bitmaps"));
+
+    var r = &scan.ram[i];
+    if (r->end - r->base < bitmap_size)
+      continue;
+
+    var bitmap = (u32 *)r->base;
+    mem_zero((bytes){bitmap_size, (u8 *)bitmap});
+    for (usize order = 0; order < P5K_PMM_ORDERS; order++) {
+      pmm.bitmaps[order] = bitmap;
+      bitmap += (pmm.pages >> order) / 32 + 1;
+    }
+    pmm.refs = (_Atomic u16 *)bitmap;
+
+    r->base += bitmap_size;
+    break;
+  }
 
+  for (usize i = 0; i < scan.ram_len; i++) {
+    p5k_log(_s("pmm: ram %x-%x"), scan.ram[i].base, scan.ram[i].end);
+    p5k_pmm_free_range(scan.ram[i].base, scan.ram[i].end);
+  }
+
+  p5k_log(_s("pmm: %d KiB free"), pmm.free * (P5K_PAGE_SIZE / 1024));
+}
+
+/* --- Kernel Heap ---------------------------------------------------------- */
+
+void *p5k_heap_alloc(void *, usize size) {
+  return p5k_pmm_alloc_pages(p5k_align_up(size, P5K_PAGE_SIZE) /
+                             P5K_PAGE_SIZE);
+}
+
+void p5k_heap_free(void *, void *ptr, usize size) {
+  p5k_pmm_free_pages(ptr, p5k_align_up(size, P5K_PAGE_SIZE) / P5K_PAGE_SIZE);
+}
+
+void p5k_heap_log(void *, enum HeapLogType type, cstr fmt, va_list args) {
+  var io = sbi_console_io();
+  io_print(io, _s("p5k: heap: "));
+  io_vprint(io, (str){cstr_len(fmt), (u8 const *)fmt}, args);
+  io_putc(io, '\n');
+
+  if (type == HEAP_ERROR)
+    p5k_panic(_s("heap: fatal error"));
+}
+
+heap p5k_heap = {
+    .alloc = p5k_heap_alloc,
+    .free = p5k_heap_free,
+    .log = p5k_heap_log,
+};
+
+/* Small objects come from the hart's own cache, which takes the heap's lock
+ * only to trade magazines with the depot. Anything else goes straight to
+ * the shared heap under that lock. */
+void p5k_heap_init(void) {
+  for (usize i = 0; i < p5k_harts.count; i++)
+    heap_cache_init(&p5k_hart_blocks[i].heap, &p5k_heap);
+}
+
+void *p5k_kalloc(usize size) {
+  return heap_cache_alloc(&p5k_hart_cpu()->heap, size);
+}
+
+void *p5k_kcalloc(usize num, usize size) {
+  usize total;
+  if (__builtin_mul_overflow(num, size, &total))
+    return nil;
+
+  void *ptr = p5k_kalloc(total);
+  if (ptr)
+    mem_zero((bytes){total, ptr});
+  return ptr;
+}
+
+void p5k_kfree(void *ptr) { heap_cache_free(&p5k_hart_cpu()->heap, ptr); }
+
+/* --- Address Spaces ------------------------------------------------------- */
+
+#define P5K_PTE_V (1 << 0)
+#define P5K_PTE_R (1 << 1)
+#define P5K_PTE_W (1 << 2)
+#define P5K_PTE_X (1 << 3)
+#define P5K_PTE_U (1 << 4)
+#define P5K_PTE_G (1 << 5)
+#define P5K_PTE_A (1 << 6)
+#define P5K_PTE_D (1 << 7)
+#define P5K_PTE_LEAF (P5K_PTE_R | P5K_PTE_W | P5K_PTE_X)
+#define P5K_PTE_FLAGS (0x3ff)
+
+#define P5K_PTE_KERNEL (P5K_PTE_G | P5K_PTE_A | P5K_PTE_D)
+
+#define P5K_PTE_MAKE(pa, flags) ((((pa) >> P5K_PAGE_SHIFT) << 10) | (flags))
+#define P5K_PTE_ADDR(pte) ((usize)((pte) >> 10) << P5K_PAGE_SHIFT)
+
+#define P5K_MEGA_SIZE (4 * 1024 * 1024)
+#define P5K_MEGA_SHIFT (22)
+#define P5K_PT_ENTRIES (1024)
+
+#define P5K_VPN1(va) (((va) >> P5K_MEGA_SHIFT) & (P5K_PT_ENTRIES - 1))
+#define P5K_VPN0(va) (((va) >> P5K_PAGE_SHIFT) & (P5K_PT_ENTRIES - 1))
+
+/* User mappings live below this address, everything above is shared with
+ * the kernel space. */
+#define P5K_USER_END (0x80000000)
+
+#define P5K_SATP_SV32 (1u << 31)
+#define P5K_SATP_ASID_SHIFT (22)
+#define P5K_SATP_ASID_MASK (0x1ff)
+
+typedef u32 p5k_pte;
+
+typedef u32 p5k_handle;
+
+typedef struct {
   union {
-    p5k_task task;
-    p5k_space space;
-    p5k_vmo vmo;
+    struct p5k_object *obj;
+    u32 next;
   };
-} p5k_object;
+  u32 gen;
+} p5k_slot;
 
-p5k_object *p5k_create(enum p5k_type type);
+/* Slots live in fixed size chunks that never move, the table grows a chunk
+ * at a time. */
+typedef struct {
+  p5k_slot **chunks;
+  _Atomic u32 len;
+  u32 free;
+  p5k_lock lock;
+} p5k_handles;
 
-p5k_object *p5k_ref(p5k_object *obj);
+typedef struct p5k_space {
+  p5k_pte *root;
+  struct p5k_mapping *mappings;
+  p5k_handles handles;
 
-p5k_object *p5k_deref(p5k_object *obj);
+  /* Guards mappings and the user half of the page tables, taken before the
+   * lock of any VMO mapped here. */
+  p5k_lock lock;
 
-/* --- Kernel Entry Point --------------------------------------------------- */
+  /* Generation in the bits above the hardware ASID width, a space whose
+   * generation is stale gets a new ASID on its next activation. */
+  u64 asid;
 
-void p5k_entry(usize hart, usize dtb) {
-  mem_zero((bytes){__bss_end - __bss_start, __bss_start});
-  sbi_console_putchar('\n');
-  p5k_log(_s("p5k version 0.0.1"), hart, dtb);
-  p5k_log(_s("hart=%x, dtb=%x"), hart, dtb);
-  p5k_log(_s("kernel=%x-%x"), &__kernel_start, &__kernel_end);
+  /* Harts whose satp points here, which are the ones a shootdown has to
+   * reach right away. The others may still hold translations tagged with
+   * the ASID from an earlier stay, stale tells them to drop those when they
+   * come back. */
+  _Atomic u32 active, stale;
+} p5k_space;
 
-  riscv_csrw(stvec, (usize)_p5k_trap);
-  riscv_unimp();
+static p5k_space p5k_kernel_space;
 
-  p5K_unreachable();
-}
\ No newline at end of file
+/* User spaces share the kernel half by copying its root entries once, so it
+ * is sealed before the first of them is created and never changes after. */
+static bool p5k_kernel_sealed;
+
+void p5k_space_check_sealed(p5k_space *space) {
+  if (space == &p5k_kernel_space && p5k_kernel_sealed)
+    p5k_panic(_s("space: kernel half changed after sealing"));
+}
+
+/* ASIDs are handed out in order, once they run out the generation moves on
+ * and the whole TLB is flushed, which is cheaper than tracking which ASIDs
+ * are still in use. Other harts flush theirs on their next switch. ASID 0
+ * belongs to the kernel space. */
+static struct {
+  usize bits;
+  u64 generation;
+  usize next;
+  p5k_lock lock;
+} p5k_asids;
+
+usize p5k_space_asid(p5k_space *space) {
+  return space->asid & (((usize)1 << p5k_asids.bits) - 1);
+}
+
+bool p5k_space_asid_live(p5k_space *space) {
+  return space == &p5k_kernel_space ||
+         (space->asid & ~(((u64)1 << p5k_asids.bits) - 1)) ==
+             p5k_asids.generation;
+}
+
+/* Callers hold p5k_asids.lock. */
+void p5k_space_asid_assign(p5k_space *space) {
+  let limit = (usize)1 << p5k_asids.bits;
+
+  if (p5k_asids.next >= limit) {
+    p5k_asids.generation += limit;
+    p5k_asids.next = 1;
+    for (usize i = 0; i < p5k_harts.count; i++)
+      atomic_store_explicit(&p5k_hart_blocks[i].asid_flush, true,
+                            memory_order_relaxed);
+  }
+
+  space->asid = p5k_asids.generation | p5k_asids.next++;
+}
+
+/* The ASID this hart's TLB tags the space's entries with. While the space
+ * is in satp that is the one in satp, which outlives a rollover until the
+ * next activation even when another hart has reassigned the space. */
+usize p5k_space_asid_local(p5k_space *space) {
+  if (p5k_hart_cpu()->space == space)
+    return (riscv_csrr(satp) >> P5K_SATP_ASID_SHIFT) & P5K_SATP_ASID_MASK;
+  return p5k_space_asid(space);
+}
+
+/* Flushes the translation of va in space, only the space's own ASID is
+ * touched unless it is the kernel space whose mappings are global. */
+void p5k_space_flush(p5k_space *space, usize va) {
+  if (space == &p5k_kernel_space || !p5k_asids.bits)
+    riscv_sfence_vma_addr(va);
+  else
+    riscv_sfence_vma_asid(va, p5k_space_asid_local(space));
+}
+
+#define P5K_TLB_RANGES (8)
+/* Past this many pages flushing the whole ASID is cheaper, on the remote
+ * harts too since SBI implementations flush a range page by page. */
+#define P5K_TLB_FLUSH_PAGES (32)
+
+/* Invalidations gathered while page tables change and flushed in one go
+ * once they are done, with one RFENCE call per range for all the remote
+ * harts together instead of one per page and hart. */
+typedef struct {
+  p5k_space *space;
+  p5k_range ranges[P5K_TLB_RANGES];
+  usize len, pages;
+} p5k_tlb_batch;
+
+bool p5k_tlb_full(p5k_tlb_batch *batch) {
+  return batch->pages > P5K_TLB_FLUSH_PAGES;
+}
+
+void p5k_tlb_add(p5k_tlb_batch *batch, usize va, usize size) {
+  let end = va + size;
+
+  batch->pages += size / P5K_PAGE_SIZE;
+  if (p5k_tlb_full(batch))
+    return;
+
+  for (usize i = 0; i < batch->len; i++) {
+    var r = &batch->ranges[i];
+    if (va <= r->end && r->base <= end) {
+      r->base = va < r->base ? va : r->base;
+      r->end = end > r->end ? end : r->end;
+      return;
+    }
+  }
+
+  if (batch->len == P5K_TLB_RANGES)
+    batch->pages = P5K_TLB_FLUSH_PAGES + 1;
+  else
+    batch->ranges[batch->len++] = (p5k_range){va, end};
+}
+
+void p5k_tlb_flush_local(p5k_tlb_batch *batch) {
+  var space = batch->space;
+  let global = space == &p5k_kernel_space || !p5k_asids.bits;
+
+  if (p5k_tlb_full(batch)) {
+    if (global)
+      riscv_sfence_vma();
+    else
+      riscv_sfence_vma_asid_all(p5k_space_asid_local(space));
+    return;
+  }
+
+  for (usize i = 0; i < batch->len; i++)
+    for (usize va = batch->ranges[i].base; va < batch->ranges[i].end;
+         va += P5K_PAGE_SIZE)
+      p5k_space_flush(space, va);
+}
+
+void p5k_tlb_flush_harts(p5k_tlb_batch *batch, u32 harts, bool global,
+                         usize asid) {
+  while (harts) {
+    usize base;
+    let window = p5k_harts_window(&harts, &base);
+
+    for (usize i = 0; i < (p5k_tlb_full(batch) ? 1 : batch->len); i++) {
+      let start = p5k_tlb_full(batch) ? 0 : batch->ranges[i].base;
+      let size = p5k_tlb_full(batch)
+                     ? (usize)-1
+                     : batch->ranges[i].end - batch->ranges[i].base;
+
+      if (global)
+        sbi_remote_sfence_vma(window, base, start, size);
+      else
+        sbi_remote_sfence_vma_asid(window, base, start, size, asid);
+    }
+  }
+}
+
+/* Harts yet to catch up with an ASID rollover may still run the space under
+ * its old ASID, those are flushed by address alone. */
+void p5k_tlb_flush_remote(p5k_tlb_batch *batch, u32 harts) {
+  var space = batch->space;
+
+  if (space == &p5k_kernel_space || !p5k_asids.bits) {
+    p5k_tlb_flush_harts(batch, harts, true, 0);
+    return;
+  }
+
+  let asid = p5k_space_asid(space);
+  u32 behind = 0;
+  for (u32 m = harts; m; m &= m - 1) {
+    let i = __builtin_ctz(m);
+    if (atomic_load_explicit(&p5k_hart_blocks[i].asid_flush,
+                             memory_order_acquire))
+      behind |= (u32)1 << i;
+  }
+
+  p5k_tlb_flush_harts(batch, behind, true, 0);
+  p5k_tlb_flush_harts(batch, harts & ~behind, false, asid);
+}
+
+/* Kernel mappings are global and reach every hart. A user space is flushed
+ * right away only where it is active, every other hart is marked stale. The
+ * stale marks go out before active is read, a hart activating the space
+ * concurrently either sees its mark or is seen as active. */
+void p5k_tlb_flush(p5k_tlb_batch *batch) {
+  var space = batch->space;
+  let self = (u32)1 << p5k_hart_self();
+  u32 active;
+
+  if (!batch->pages)
+    return;
+
+  if (space == &p5k_kernel_space) {
+    active = atomic_load_explicit(&p5k_harts.online, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+  } else {
+    if (p5k_asids.bits)
+      atomic_fetch_or_explicit(&space->stale, (u32)-1, memory_order_seq_cst);
+    else
+      atomic_thread_fence(memory_order_seq_cst);
+    active = atomic_load_explicit(&space->active, memory_order_seq_cst);
+  }
+
+  if (space == &p5k_kernel_space || (active & self))
+    p5k_tlb_flush_local(batch);
+  p5k_tlb_flush_remote(batch, active & ~self);
+}
+
+p5k_pte *p5k_pt_alloc(void) {
+  p5k_pte *pt = p5k_pmm_alloc(0);
+  if (pt)
+    mem_zero((bytes){P5K_PAGE_SIZE, (u8 *)pt});
+  return pt;
+}
+
+/* Replaces a megapage by a page table mapping the same 4MiB with the same
+ * permissions, so part of it can be remapped. */
+bool p5k_space_split(p5k_pte *pte) {
+  p5k_pte *pt = p5k_pt_alloc();
+  if (!pt)
+    return false;
+
+  let pa = P5K_PTE_ADDR(*pte);
+  let flags = *pte & P5K_PTE_FLAGS;
+  for (usize i = 0; i < P5K_PT_ENTRIES; i++)
+    pt[i] = P5K_PTE_MAKE(pa + i * P5K_PAGE_SIZE, flags);
+
+  *pte = P5K_PTE_MAKE((usize)pt, P5K_PTE_V);
+  return true;
+}
+
+/* Returns the leaf entry for va, which is the megapage entry if va is mapped
+ * by one. Missing tables are allocated when alloc is set. */
+p5k_pte *p5k_space_walk(p5k_space *space, usize va, bool alloc) {
+  p5k_pte *pte = &space->root[P5K_VPN1(va)];
+
+  if (*pte & P5K_PTE_V) {
+    if (*pte & P5K_PTE_LEAF)
+      return pte;
+  } else {
+    if (!alloc)
+      return nil;
+
+    p5k_pte *pt = p5k_pt_alloc();
+    if (!pt)
+      return nil;
+    *pte = P5K_PTE_MAKE((usize)pt, P5K_PTE_V);
+  }
+
+  return &((p5k_pte *)P5K_PTE_ADDR(*pte))[P5K_VPN0(va)];
+}
+
+bool p5k_space_map(p5k_space *space, usize va, usize pa, usize size,
+                   u32 flags) {
+  let end = va + size;
+
+  p5k_space_check_sealed(space);
+
+  while (va < end) {
+    p5k_pte *pte = &space->root[P5K_VPN1(va)];
+
+    if (!((va | pa) & (P5K_MEGA_SIZE - 1)) && end - va >= P5K_MEGA_SIZE &&
+        !(*pte & P5K_PTE_V)) {
+      *pte = P5K_PTE_MAKE(pa, flags | P5K_PTE_V);
+      va += P5K_MEGA_SIZE;
+      pa += P5K_MEGA_SIZE;
+      continue;
+    }
+
+    if ((*pte & P5K_PTE_V) && (*pte & P5K_PTE_LEAF) && !p5k_space_split(pte))
+      return false;
+
+    pte = p5k_space_walk(space, va, true);
+    if (!pte)
+      return false;
+
+    *pte = P5K_PTE_MAKE(pa, flags | P5K_PTE_V);
+    va += P5K_PAGE_SIZE;
+    pa += P5K_PAGE_SIZE;
+  }
+
+  return true;
+}
+
+void p5k_space_unmap(p5k_space *space, usize va, usize size) {
+  p5k_tlb_batch batch = {.space = space};
+  let end = va + size;
+
+  p5k_space_check_sealed(space);
+
+  while (va < end) {
+    p5k_pte *pte = &space->root[P5K_VPN1(va)];
+
+    if (!(*pte & P5K_PTE_V)) {
+      va = (va & ~(P5K_MEGA_SIZE - 1)) + P5K_MEGA_SIZE;
+      continue;
+    }
+
+    if (*pte & P5K_PTE_LEAF) {
+      if (!(va & (P5K_MEGA_SIZE - 1)) && end - va >= P5K_MEGA_SIZE) {
+        *pte = 0;
+        p5k_tlb_add(&batch, va, P5K_MEGA_SIZE);
+        va += P5K_MEGA_SIZE;
+        continue;
+      }
+
+      if (!p5k_space_split(pte))
+        p5k_panic(_s("space: out of memory splitting a megapage"));
+    }
+
+    pte = p5k_space_walk(space, va, false);
+    if (*pte) {
+      *pte = 0;
+      p5k_tlb_add(&batch, va, P5K_PAGE_SIZE);
+    }
+    va += P5K_PAGE_SIZE;
+  }
+
+  p5k_tlb_flush(&batch);
+}
+
+/* The kernel half is copied from the sealed kernel space, user mappings stay
+ * below P5K_USER_END and never touch it. */
+p5k_space *p5k_space_init(p5k_space *space) {
+  if (!p5k_kernel_sealed)
+    p5k_panic(_s("space: created before the kernel half is sealed"));
+
+  *space = (p5k_space){.root = p5k_pt_alloc()};
+  if (!space->root)
+    return nil;
+
+  for (usize i = P5K_VPN1(P5K_USER_END); i < P5K_PT_ENTRIES; i++)
+    space->root[i] = p5k_kernel_space.root[i];
+
+  return space;
+}
+
+void p5k_space_unmap_all(p5k_space *space);
+
+void p5k_handles_fini(p5k_handles *handles);
+
+void p5k_space_fini(p5k_space *space) {
+  p5k_handles_fini(&space->handles);
+  p5k_space_unmap_all(space);
+
+  for (usize i = 0; i < P5K_VPN1(P5K_USER_END); i++) {
+    let pte = space->root[i];
+    if ((pte & P5K_PTE_V) && !(pte & P5K_PTE_LEAF))
+      p5k_pmm_free((void *)P5K_PTE_ADDR(pte), 0);
+  }
+
+  p5k_pmm_free(space->root, 0);
+  space->root = nil;
+}
+
+usize p5k_space_satp(p5k_space *space) {
+  return P5K_SATP_SV32 | (p5k_space_asid(space) << P5K_SATP_ASID_SHIFT) |
+         ((usize)space->root >> P5K_PAGE_SHIFT);
+}
+
+/* Switching keeps the TLB entries of other spaces, tagged with their own
+ * ASID, unless the hart has no ASIDs at all. Those of the space switched to
+ * are dropped if it was shot down while the hart was away. */
+void p5k_space_activate(p5k_space *space) {
+  var hart = p5k_hart_cpu();
+  let self = (u32)1 << hart->index;
+
+  if (p5k_asids.bits) {
+    p5k_lock_acquire(&p5k_asids.lock);
+    if (!p5k_space_asid_live(space))
+      p5k_space_asid_assign(space);
+    p5k_lock_release(&p5k_asids.lock);
+  }
+
+  if (hart->space != space) {
+    if (hart->space)
+      atomic_fetch_and_explicit(&hart->space->active, ~self,
+                                memory_order_relaxed);
+    atomic_fetch_or_explicit(&space->active, self, memory_order_seq_cst);
+  }
+
+  hart->space = space;
+  riscv_csrw(satp, p5k_space_satp(space));
+
+  let stale = atomic_fetch_and_explicit(&space->stale, ~self,
+                                        memory_order_seq_cst) &
+              self;
+
+  if (!p5k_asids.bits ||
+      atomic_exchange_explicit(&hart->asid_flush, false, memory_order_relaxed))
+    riscv_sfence_vma();
+  else if (stale)
+    riscv_sfence_vma_asid_all(p5k_space_asid(space));
+}
+
+/* The ASID field is WARL, the bits that stick after writing all ones are the
+ * ones the hart implements. */
+void p5k_space_asid_init(void) {
+  riscv_csrw(satp, p5k_space_satp(&p5k_kernel_space) |
+                       (P5K_SATP_ASID_MASK << P5K_SATP_ASID_SHIFT));
+  let asid = (riscv_csrr(satp) >> P5K_SATP_ASID_SHIFT) & P5K_SATP_ASID_MASK;
+
+  p5k_asids.bits = __builtin_popcount(asid);
+  p5k_asids.generation = (u64)1 << p5k_asids.bits;
+  p5k_asids.next = 1;
+}
+
+/* The kernel runs identity mapped, RAM is direct mapped RW with megapages and
+ * the image is remapped on top with 4KiB pages where its permissions differ,
+ * only the megapage holding the image ends up split. This is the whole
+ * kernel half, it is sealed on the way out. */
+void p5k_space_init_kernel(void) {
+  p5k_space *space = &p5k_kernel_space;
+
+  struct {
+    usize start, end;
+    u32 flags;
+  } sections[] = {
+      {(usize)__text_start, (usize)__text_end, P5K_PTE_R | P5K_PTE_X},
+      {(usize)__rodata_start, (usize)__rodata_end, P5K_PTE_R},
+      {(usize)__data_start, (usize)__data_end, P5K_PTE_R | P5K_PTE_W},
+  };
+
+  space->root = p5k_pt_alloc();
+  if (!space->root)
+    p5k_panic(_s("space: out of memory"));
+
+  if (!p5k_space_map(space, pmm.base, pmm.base, pmm.end - pmm.base,
+                     P5K_PTE_R | P5K_PTE_W | P5K_PTE_KERNEL))
+    p5k_panic(_s("space: out of memory mapping ram"));
+
+  for (usize i = 0; i < sizeof(sections) / sizeof(*sections); i++) {
+    if (!p5k_space_map(space, sections[i].start, sections[i].start,
+                       sections[i].end - sections[i].start,
+                       sections[i].flags | P5K_PTE_KERNEL))
+      p5k_panic(_s("space: out of memory mapping the kernel"));
+  }
+
+  p5k_kernel_sealed = true;
+
+  p5k_space_asid_init();
+  p5k_space_activate(space);
+  riscv_sfence_vma();
+  p5k_log(_s("space: paging enabled, root=%x, asid bits=%d"), space->root,
+          p5k_asids.bits);
+}
+
+/* --- Virtual Memory Objects ---------------------------------------------- */
+
+#define P5K_VMO_LEAF (P5K_PAGE_SIZE / sizeof(usize))
+
+/* A VMO is a sparse array of frames indexed by page, kept in a two level
+ * table whose leaves are only allocated once a page in their range is
+ * touched. Frames are shared copy-on-write between a VMO and its clones. */
+typedef struct p5k_vmo {
+  usize size;
+  usize **dir;
+  usize dir_len;
+  struct p5k_mapping *mappings;
+
+  /* Guards the directory, the frames in it and mappings. */
+  p5k_lock lock;
+} p5k_vmo;
+
+typedef struct p5k_mapping {
+  struct p5k_mapping *next;
+  struct p5k_mapping *vmo_next;
+  p5k_space *space;
+  p5k_vmo *vmo;
+  usize va, size, offset;
+  u32 flags;
+} p5k_mapping;
+
+usize *p5k_vmo_slot(p5k_vmo *vmo, usize index, bool alloc) {
+  let d = index / P5K_VMO_LEAF;
+
+  if (!vmo->dir[d]) {
+    if (!alloc)
+      return nil;
+
+    vmo->dir[d] = p5k_pmm_alloc(0);
+    if (!vmo->dir[d])
+      return nil;
+    mem_zero((bytes){P5K_PAGE_SIZE, (u8 *)vmo->dir[d]});
+  }
+
+  return &vmo->dir[d][index % P5K_VMO_LEAF];
+}
+
+p5k_vmo *p5k_vmo_init(p5k_vmo *vmo, usize size) {
+  size = p5k_align_up(size, P5K_PAGE_SIZE);
+
+  *vmo = (p5k_vmo){
+      .size = size,
+      .dir_len = (size / P5K_PAGE_SIZE + P5K_VMO_LEAF - 1) / P5K_VMO_LEAF,
+  };
+
+  vmo->dir = p5k_kcalloc(vmo->dir_len ? vmo->dir_len : 1, sizeof(usize *));
+  if (!vmo->dir)
+    return nil;
+
+  return vmo;
+}
+
+/* Drops every page table entry pointing into the VMO, the next access goes
+ * through the fault path again and picks up the current frame. Called with
+ * the VMO lock held. The spaces are not locked: only leaf entries are
+ * cleared, and a fault that would map these pages again waits for the VMO
+ * lock. */
+void p5k_vmo_unmap(p5k_vmo *vmo) {
+  for (p5k_mapping *map = vmo->mappings; map; map = map->vmo_next)
+    p5k_space_unmap(map->space, map->va, map->size);
+}
+
+void p5k_vmo_unmap_page(p5k_vmo *vmo, usize index) {
+  let offset = index * P5K_PAGE_SIZE;
+
+  for (p5k_mapping *map = vmo->mappings; map; map = map->vmo_next) {
+    if (offset < map->offset || offset >= map->offset + map->size)
+      continue;
+    p5k_space_unmap(map->space, map->va + offset - map->offset,
+                    P5K_PAGE_SIZE);
+  }
+}
+
+void p5k_vmo_fini(p5k_vmo *vmo);
+
+/* Shares every populated page of src with dst. Existing mappings of src are
+ * dropped so they fault back in read-only and copy on their next write. On
+ * failure dst is left empty and src untouched. */
+p5k_vmo *p5k_vmo_clone(p5k_vmo *dst, p5k_vmo *src) {
+  if (!p5k_vmo_init(dst, src->size))
+    return nil;
+
+  p5k_lock_acquire(&src->lock);
+
+  for (usize d = 0; d < src->dir_len; d++) {
+    if (!src->dir[d])
+      continue;
+
+    dst->dir[d] = p5k_pmm_alloc(0);
+    if (!dst->dir[d]) {
+      p5k_lock_release(&src->lock);
+      p5k_vmo_fini(dst);
+      return nil;
+    }
+
+    for (usize i = 0; i < P5K_VMO_LEAF; i++) {
+      dst->dir[d][i] = src->dir[d][i];
+      if (src->dir[d][i])
+        p5k_frame_ref(src->dir[d][i]);
+    }
+  }
+
+  p5k_vmo_unmap(src);
+  p5k_lock_release(&src->lock);
+  return dst;
+}
+
+void p5k_space_unmap_vmo(p5k_space *space, usize va);
+
+void p5k_vmo_fini(p5k_vmo *vmo) {
+  while (vmo->mappings)
+    p5k_space_unmap_vmo(vmo->mappings->space, vmo->mappings->va);
+
+  for (usize d = 0; d < vmo->dir_len; d++) {
+    if (!vmo->dir[d])
+      continue;
+
+    for (usize i = 0; i < P5K_VMO_LEAF; i++)
+      if (vmo->dir[d][i])
+        p5k_frame_deref(vmo->dir[d][i]);
+    p5k_pmm_free(vmo->dir[d], 0);
+  }
+
+  p5k_kfree(vmo->dir);
+  vmo->dir = nil;
+}
+
+/* Maps size bytes of vmo at offset into space. Nothing is populated, pages
+ * are faulted in on first access. */
+bool p5k_space_map_vmo(p5k_space *space, usize va, p5k_vmo *vmo, usize offset,
+                       usize size, u32 flags) {
+  if ((va | offset | size) & (P5K_PAGE_SIZE - 1) || va + size > P5K_USER_END ||
+      offset + size > vmo->size)
+    return false;
+
+  p5k_mapping *map = p5k_kalloc(sizeof(p5k_mapping));
+  if (!map)
+    return false;
+
+  p5k_lock_acquire(&space->lock);
+
+  for (p5k_mapping *other = space->mappings; other; other = other->next) {
+    if (va < other->va + other->size && other->va < va + size) {
+      p5k_lock_release(&space->lock);
+      p5k_kfree(map);
+      return false;
+    }
+  }
+
+  p5k_lock_acquire(&vmo->lock);
+  *map = (p5k_mapping){
+      .next = space->mappings,
+      .vmo_next = vmo->mappings,
+      .space = space,
+      .vmo = vmo,
+      .va = va,
+      .size = size,
+      .offset = offset,
+      .flags = flags & P5K_PTE_LEAF,
+  };
+
+  space->mappings = map;
+  vmo->mappings = map;
+  p5k_lock_release(&vmo->lock);
+
+  p5k_lock_release(&space->lock);
+  return true;
+}
+
+void p5k_space_unmap_vmo(p5k_space *space, usize va) {
+  p5k_lock_acquire(&space->lock);
+  p5k_mapping **link = &space->mappings;
+
+  while (*link && (*link)->va != va)
+    link = &(*link)->next;
+
+  p5k_mapping *map = *link;
+  if (!map) {
+    p5k_lock_release(&space->lock);
+    return;
+  }
+  *link = map->next;
+
+  var vmo = map->vmo;
+  p5k_lock_acquire(&vmo->lock);
+  link = &vmo->mappings;
+  while (*link != map)
+    link = &(*link)->vmo_next;
+  *link = map->vmo_next;
+  p5k_lock_release(&vmo->lock);
+
+  p5k_space_unmap(space, map->va, map->size);
+  p5k_lock_release(&space->lock);
+  p5k_kfree(map);
+}
+
+void p5k_space_unmap_all(p5k_space *space) {
+  while (space->mappings)
+    p5k_space_unmap_vmo(space, space->mappings->va);
+}
+
+/* Returns the frame for the page at index, allocating a zeroed one on first
+ * touch and copying a shared one on write, or 0 when out of memory. Called
+ * with the VMO lock held, harts faulting on the same page through different
+ * spaces agree on its frame. */
+usize p5k_vmo_fault(p5k_vmo *vmo, usize index, bool write) {
+  usize *slot = p5k_vmo_slot(vmo, index, true);
+  if (!slot)
+    return 0;
+
+  if (!*slot) {
+    *slot = p5k_frame_alloc(true);
+  } else if (write && p5k_frame_refs(*slot) > 1) {
+    let frame = p5k_frame_alloc(false);
+    if (!frame)
+      return 0;
+
+    mem_copy((bytes){P5K_PAGE_SIZE, (u8 *)frame},
+             (bytes){P5K_PAGE_SIZE, (u8 *)*slot});
+    p5k_frame_deref(*slot);
+    *slot = frame;
+
+    /* Other mappings of this VMO may still point at the shared frame. */
+    p5k_vmo_unmap_page(vmo, index);
+  }
+
+  return *slot;
+}
+
+/* Populates the page holding va. Shared frames are mapped read-only. */
+bool p5k_space_fault(p5k_space *space, usize va, bool write, bool exec) {
+  p5k_lock_acquire(&space->lock);
+  p5k_mapping *map = space->mappings;
+
+  while (map && (va < map->va || va >= map->va + map->size))
+    map = map->next;
+
+  if (!map || (write && !(map->flags & P5K_PTE_W)) ||
+      (exec && !(map->flags & P5K_PTE_X)) ||
+      (!write && !exec && !(map->flags & P5K_PTE_R))) {
+    p5k_lock_release(&space->lock);
+    return false;
+  }
+
+  var vmo = map->vmo;
+  let page = va & ~(P5K_PAGE_SIZE - 1);
+  let index = (page - map->va + map->offset) / P5K_PAGE_SIZE;
+  u32 flags = map->flags | P5K_PTE_U | P5K_PTE_A | P5K_PTE_D;
+
+  p5k_lock_acquire(&vmo->lock);
+  let frame = p5k_vmo_fault(vmo, index, write);
+  if (frame && p5k_frame_refs(frame) > 1)
+    flags &= ~(P5K_PTE_W | P5K_PTE_D);
+  let ok = frame && p5k_space_map(space, page, frame, P5K_PAGE_SIZE, flags);
+  p5k_lock_release(&vmo->lock);
+
+  if (ok)
+    p5k_space_flush(space, page);
+  p5k_lock_release(&space->lock);
+  return ok;
+}
+
+bool p5k_fault(usize addr, usize cause) {
+  var space = p5k_hart_cpu()->space;
+  if (!space)
+    return false;
+
+  switch (cause) {
+  case RISCV_EXC_LOAD_PAGE_FAULT:
+    return p5k_space_fault(space, addr, false, false);
+  case RISCV_EXC_STORE_PAGE_FAULT:
+    return p5k_space_fault(space, addr, true, false);
+  case RISCV_EXC_INST_PAGE_FAULT:
+    return p5k_space_fault(space, addr, false, true);
+  default:
+    return false;
+  }
+}
+
+/* --- Extension State ------------------------------------------------------ */
+
+/* F/D and V registers are switched lazily. A task enters with FS/VS Off
+ * unless its registers are still live on the hart, and its first use traps
+ * and loads them. On the way out they are only saved if the hardware marked
+ * them Dirty, so integer-only tasks and the kernel never pay for them. */
+
+typedef struct {
+  u64 f[32];
+  u32 fcsr;
+} p5k_fpu_state;
+
+typedef struct {
+  u32 vstart, vl, vtype, vcsr;
+  u8 v[];
+} p5k_vec_state;
+
+/* The harts whose registers were last loaded from the state, a task that
+ * ran elsewhere since is no longer live on the hart it left. */
+typedef struct p5k_ext {
+  p5k_fpu_state *fpu;
+  p5k_vec_state *vec;
+  p5k_hart *fpu_hart, *vec_hart;
+} p5k_ext;
+
+/* The current task's state and the owners, whose registers the hart holds,
+ * live in the hart's block. */
+static struct {
+  usize vec_size;
+} p5k_exts;
+
+extern void p5k_fpu_save(p5k_fpu_state *state);
+extern void p5k_fpu_load(p5k_fpu_state const *state);
+extern void p5k_vec_save(p5k_vec_state *state);
+extern void p5k_vec_load(p5k_vec_state const *state);
+
+#define P5K_XS_MASK(shift) ((usize)RISCV_XS_DIRTY << (shift))
+
+enum riscv_xs p5k_xs_get(usize sstatus, usize shift) {
+  return (sstatus >> shift) & RISCV_XS_DIRTY;
+}
+
+usize p5k_xs_set(usize sstatus, usize shift, enum riscv_xs xs) {
+  return (sstatus & ~P5K_XS_MASK(shift)) | ((usize)xs << shift);
+}
+
+/* Which extension an illegal instruction belongs to: the F/D opcodes and
+ * compressed loads and stores, OP-V and the vector widths of LOAD-FP and
+ * STORE-FP, and the CSRs each of them owns. */
+u32 p5k_insn_ext(u32 insn) {
+  if ((insn & 3) != 3) {
+    let quadrant = insn & 3;
+    let funct3 = (insn >> 13) & 7;
+    let fp = funct3 == 1 || funct3 == 5 ||
+             (sizeof(usize) == 4 && (funct3 == 3 || funct3 == 7));
+    return (quadrant == 0 || quadrant == 2) && fp ? P5K_HART_FPU : 0;
+  }
+
+  let width = (insn >> 12) & 7;
+  let csr = insn >> 20;
+
+  switch (insn & 0x7f) {
+  case 0x07:
+  case 0x27:
+    return width >= 1 && width <= 4 ? P5K_HART_FPU : P5K_HART_VECTOR;
+  case 0x43:
+  case 0x47:
+  case 0x4b:
+  case 0x4f:
+  case 0x53:
+    return P5K_HART_FPU;
+  case 0x57:
+    return P5K_HART_VECTOR;
+  case 0x73:
+    if (!width)
+      return 0;
+    if (csr >= 0x001 && csr <= 0x003)
+      return P5K_HART_FPU;
+    if ((csr >= 0x008 && csr <= 0x00a) || csr == 0x00f ||
+        (csr >= 0xc20 && csr <= 0xc22))
+      return P5K_HART_VECTOR;
+    return 0;
+  default:
+    return 0;
+  }
+}
+
+/* Reads the halfword at a user va through the page tables of the active
+ * space rather than with SUM, which would fault on execute-only pages and on
+ * pages unmapped meanwhile by another hart. */
+bool p5k_insn_half(usize va, u16 *half) {
+  var space = p5k_hart_cpu()->space;
+  p5k_pte const want = P5K_PTE_V | P5K_PTE_X | P5K_PTE_U;
+
+  p5k_pte *pte = space ? p5k_space_walk(space, va, false) : nil;
+  if (!pte || (*pte & want) != want)
+    return false;
+
+  let mask = pte == &space->root[P5K_VPN1(va)] ? P5K_MEGA_SIZE - 1
+                                                : P5K_PAGE_SIZE - 1;
+  *half = *(u16 const *)(P5K_PTE_ADDR(*pte) + (va & mask));
+  return true;
+}
+
+/* stval holds the instruction when the hart reports it, otherwise it is read
+ * back from user memory. Returns 0 when pc cannot be read, which no
+ * extension claims. */
+u32 p5k_insn_fetch(usize pc) {
+  u32 insn = riscv_csrr(stval);
+  u16 lo, hi;
+
+  if (insn)
+    return insn;
+
+  if (!p5k_insn_half(pc, &lo))
+    return 0;
+  if ((lo & 3) != 3)
+    return lo;
+  if (!p5k_insn_half(pc + 2, &hi))
+    return 0;
+
+  return lo | (u32)hi << 16;
+}
+
+void *p5k_ext_alloc(usize size) {
+  void *state = p5k_kalloc(size);
+  if (state)
+    mem_zero((bytes){size, state});
+  return state;
+}
+
+bool p5k_ext_live(p5k_ext *ext, p5k_hart *hart, u32 kind) {
+  if (kind == P5K_HART_FPU)
+    return hart->fpu_owner == ext && ext->fpu_hart == hart;
+  return hart->vec_owner == ext && ext->vec_hart == hart;
+}
+
+/* Turns the unit on for the trapping task and leaves it Clean, the loads
+ * are skipped when its registers are still live. */
+bool p5k_ext_load(p5k_ext *ext, u32 kind) {
+  var hart = p5k_hart_cpu();
+
+  if (kind == P5K_HART_FPU) {
+    if (!ext->fpu && !(ext->fpu = p5k_ext_alloc(sizeof(p5k_fpu_state))))
+      return false;
+
+    riscv_csrs(sstatus, P5K_XS_MASK(RISCV_SSTATUS_FS_SHIFT));
+    if (!p5k_ext_live(ext, hart, kind))
+      p5k_fpu_load(ext->fpu);
+    riscv_csrc(sstatus, (usize)1 << RISCV_SSTATUS_FS_SHIFT);
+    hart->fpu_owner = ext;
+    ext->fpu_hart = hart;
+  } else {
+    if (!ext->vec && !(ext->vec = p5k_ext_alloc(p5k_exts.vec_size)))
+      return false;
+
+    riscv_csrs(sstatus, P5K_XS_MASK(RISCV_SSTATUS_VS_SHIFT));
+    if (!p5k_ext_live(ext, hart, kind))
+      p5k_vec_load(ext->vec);
+    riscv_csrc(sstatus, (usize)1 << RISCV_SSTATUS_VS_SHIFT);
+    hart->vec_owner = ext;
+    ext->vec_hart = hart;
+  }
+
+  return true;
+}
+
+/* Fast handler for illegal instructions, the unit's state is live in
+ * sstatus since the fast path neither saves nor restores it. */
+bool p5k_ext_trap(p5k_frame *frame) {
+  let sstatus = riscv_csrr(sstatus);
+  let insn = p5k_insn_fetch(frame->sepc);
+  let kind = p5k_insn_ext(insn);
+  let shift = kind == P5K_HART_FPU ? RISCV_SSTATUS_FS_SHIFT
+                                   : RISCV_SSTATUS_VS_SHIFT;
+  var ext = p5k_hart_cpu()->ext;
+
+  if (sstatus & RISCV_SSTATUS_SPP)
+    p5k_panic(_s("trap: illegal instruction %x at %x"), insn, frame->sepc);
+
+  if (ext && kind && p5k_hart_has(kind) &&
+      p5k_xs_get(sstatus, shift) == RISCV_XS_OFF && p5k_ext_load(ext, kind))
+    return false;
+
+  p5k_log(_s("trap: illegal instruction %x at %x"), insn, frame->sepc);
+  return p5k_task_fault();
+}
+
+/* Called with the full frame of a task being switched out. */
+void p5k_ext_leave(p5k_ext *ext, p5k_frame *frame) {
+  var sstatus = frame->sstatus;
+
+  if (p5k_xs_get(sstatus, RISCV_SSTATUS_FS_SHIFT) == RISCV_XS_DIRTY) {
+    p5k_fpu_save(ext->fpu);
+    sstatus = p5k_xs_set(sstatus, RISCV_SSTATUS_FS_SHIFT, RISCV_XS_CLEAN);
+  }
+
+  if (p5k_xs_get(sstatus, RISCV_SSTATUS_VS_SHIFT) == RISCV_XS_DIRTY) {
+    p5k_vec_save(ext->vec);
+    sstatus = p5k_xs_set(sstatus, RISCV_SSTATUS_VS_SHIFT, RISCV_XS_CLEAN);
+  }
+
+  frame->sstatus = sstatus;
+  p5k_hart_cpu()->ext = nil;
+}
+
+/* Called with the full frame of a task being switched in. */
+void p5k_ext_enter(p5k_ext *ext, p5k_frame *frame) {
+  var hart = p5k_hart_cpu();
+  var sstatus = frame->sstatus;
+
+  sstatus = p5k_xs_set(sstatus, RISCV_SSTATUS_FS_SHIFT,
+                       p5k_ext_live(ext, hart, P5K_HART_FPU) ? RISCV_XS_CLEAN
+                                                             : RISCV_XS_OFF);
+  sstatus = p5k_xs_set(sstatus, RISCV_SSTATUS_VS_SHIFT,
+                       p5k_ext_live(ext, hart, P5K_HART_VECTOR)
+                           ? RISCV_XS_CLEAN
+                           : RISCV_XS_OFF);
+
+  frame->sstatus = sstatus;
+  hart->ext = ext;
+}
+
+/* Owners on other harts may keep pointing at a freed state, they never
+ * match again since a new state starts out with no hart. */
+void p5k_ext_fini(p5k_ext *ext) {
+  var hart = p5k_hart_cpu();
+
+  if (hart->fpu_owner == ext)
+    hart->fpu_owner = nil;
+  if (hart->vec_owner == ext)
+    hart->vec_owner = nil;
+  if (hart->ext == ext)
+    hart->ext = nil;
+
+  if (ext->fpu)
+    p5k_kfree(ext->fpu);
+  if (ext->vec)
+    p5k_kfree(ext->vec);
+  *ext = (p5k_ext){};
+}
+
+/* The kernel runs with both units off, a stray use of either traps. */
+void p5k_ext_init_hart(void) {
+  riscv_csrc(sstatus, P5K_XS_MASK(RISCV_SSTATUS_FS_SHIFT) |
+                          P5K_XS_MASK(RISCV_SSTATUS_VS_SHIFT));
+}
+
+void p5k_ext_init(void) {
+  if (p5k_hart_has(P5K_HART_VECTOR)) {
+    riscv_csrs(sstatus, (usize)RISCV_XS_INITIAL << RISCV_SSTATUS_VS_SHIFT);
+    p5k_exts.vec_size = sizeof(p5k_vec_state) + 32 * riscv_csrr(0xc22);
+    riscv_csrc(sstatus, P5K_XS_MASK(RISCV_SSTATUS_VS_SHIFT));
+  }
+
+  p5k_trap_register(RISCV_EXC_ILLEGAL_INST, p5k_ext_trap);
+  p5k_log(_s("ext: fpu %s, vector state %d bytes"),
+          p5k_hart_has(P5K_HART_FPU) ? "on" : "off", p5k_exts.vec_size);
+}
+
+/* --- Kernel Object -------------------------------------------------------- */
+
+enum p5k_task_state {
+  P5K_TASK_BLOCKED,
+  P5K_TASK_READY,
+  P5K_TASK_RUNNING,
+  P5K_TASK_EXITED,
+};
+
+/* A task's frame sits at the top of its kernel stack while it is off the
+ * hart, on_hart stays set until it has been saved there. */
+typedef struct p5k_task {
+  p5k_frame *frame;
+  struct p5k_object *space;
+  void *stack;
+
+  _Atomic u32 state;
+  _Atomic bool on_hart;
+  usize hart;
+  u8 prio;
+  u64 deadline;
+  struct p5k_task *link, *child;
+
+  /* The caller waiting for this task's reply. */
+  struct p5k_task *reply;
+
+  /* The channel this task sleeps on and the ring and index it waits for,
+   * cleared by whoever takes it out of the channel's waiters. */
+  struct p5k_object *sleeps_on;
+  usize sleep_ring, sleep_word;
+
+  p5k_ext ext;
+} p5k_task;
+
+typedef struct {
+  p5k_task *head, *tail;
+} p5k_fifo;
+
+/* Returned to user space in a0. */
+enum p5k_status {
+  P5K_OK = 0,
+  P5K_ERR_HANDLE = -1,
+  P5K_ERR_SYSCALL = -2,
+  P5K_ERR_CLOSED = -3,
+  P5K_ERR_INVALID = -4,
+};
+
+/* Tasks blocked on either side of a call, only one queue is ever non-empty
+ * at a time. */
+typedef struct {
+  p5k_lock lock;
+  p5k_fifo senders, receivers;
+} p5k_endpoint;
+
+/* A VMO shared by the tasks at both ends, laid out as in p5k-ring/ring.h,
+ * and whoever sleeps on each index of its rings. */
+typedef struct {
+  p5k_lock lock;
+  struct p5k_object *vmo;
+  p5k_rings *rings;
+  p5k_task *waiters[2][2];
+} p5k_channel;
+
+void p5k_task_fini(p5k_task *task);
+
+void p5k_endpoint_fini(p5k_endpoint *ep);
+
+void p5k_channel_fini(p5k_channel *ch);
+
+typedef struct p5k_object {
+  _Atomic usize refs;
+
+  enum p5k_type {
+    P5K_TYPE_NONE,
+    P5K_TYPE_TASK,
+    P5K_TYPE_SPACE,
+    P5K_TYPE_VMO,
+    P5K_TYPE_ENDPOINT,
+    P5K_TYPE_CHANNEL,
+
+    P5K_TYPE_COUNT,
+  } type;
+
+  union {
+    p5k_task task;
+    p5k_space space;
+    p5k_vmo vmo;
+    p5k_endpoint endpoint;
+    p5k_channel channel;
+  };
+} p5k_object;
+
+/* Objects of each type come from their own pool of page-carved slots, pages
+ * are kept by the pool once carved. */
+typedef struct {
+  void *free;
+  p5k_lock lock;
+} p5k_pool;
+
+static p5k_pool p5k_pools[P5K_TYPE_COUNT];
+
+p5k_object *p5k_pool_alloc(p5k_pool *pool) {
+  p5k_lock_acquire(&pool->lock);
+
+  if (!pool->free) {
+    u8 *page = p5k_pmm_alloc(0);
+    if (!page) {
+      p5k_lock_release(&pool->lock);
+      return nil;
+    }
+
+    for (usize i = 0; i + sizeof(p5k_object) <= P5K_PAGE_SIZE;
+         i += sizeof(p5k_object)) {
+      *(void **)(page + i) = pool->free;
+      pool->free = page + i;
+    }
+  }
+
+  p5k_object *obj = pool->free;
+  pool->free = *(void **)obj;
+
+  p5k_lock_release(&pool->lock);
+  return obj;
+}
+
+void p5k_pool_free(p5k_pool *pool, p5k_object *obj) {
+  p5k_lock_acquire(&pool->lock);
+  *(void **)obj = pool->free;
+  pool->free = obj;
+  p5k_lock_release(&pool->lock);
+}
+
+/* Creates an object holding one reference. Spaces come initialised, the
+ * other types are left zeroed for their init function. */
+p5k_object *p5k_create(enum p5k_type type) {
+  if (type == P5K_TYPE_NONE || type >= P5K_TYPE_COUNT)
+    return nil;
+
+  p5k_object *obj = p5k_pool_alloc(&p5k_pools[type]);
+  if (!obj)
+    return nil;
+
+  mem_zero((bytes){sizeof(p5k_object), (u8 *)obj});
+  obj->type = type;
+  atomic_init(&obj->refs, 1);
+
+  if (type == P5K_TYPE_SPACE && !p5k_space_init(&obj->space)) {
+    p5k_pool_free(&p5k_pools[type], obj);
+    return nil;
+  }
+
+  return obj;
+}
+
+p5k_object *p5k_ref(p5k_object *obj) {
+  atomic_fetch_add_explicit(&obj->refs, 1, memory_order_relaxed);
+  return obj;
+}
+
+/* Drops a reference, returns nil once the object is destroyed. */
+p5k_object *p5k_deref(p5k_object *obj) {
+  if (atomic_fetch_sub_explicit(&obj->refs, 1, memory_order_release) != 1)
+    return obj;
+
+  atomic_thread_fence(memory_order_acquire);
+
+  switch (obj->type) {
+  case P5K_TYPE_TASK:
+    p5k_task_fini(&obj->task);
+    break;
+  case P5K_TYPE_SPACE:
+    if (obj->space.root)
+      p5k_space_fini(&obj->space);
+    break;
+  case P5K_TYPE_VMO:
+    if (obj->vmo.dir)
+      p5k_vmo_fini(&obj->vmo);
+    break;
+  case P5K_TYPE_ENDPOINT:
+    p5k_endpoint_fini(&obj->endpoint);
+    break;
+  case P5K_TYPE_CHANNEL:
+    if (obj->channel.vmo)
+      p5k_channel_fini(&obj->channel);
+    break;
+  default:
+    break;
+  }
+
+  p5k_pool_free(&p5k_pools[obj->type], obj);
+  return nil;
+}
+
+/* --- Handle Table --------------------------------------------------------- */
+
+/* A handle is a slot index and the generation of the slot when the handle
+ * was made. The generation is bumped both when a slot is handed out and when
+ * it is freed, so it is odd exactly while the slot is in use and stale
+ * handles miss. Odd generations also keep every handle non-zero. */
+#define P5K_HANDLE_INDEX_BITS (16)
+#define P5K_HANDLE_INDEX_MASK ((1u << P5K_HANDLE_INDEX_BITS) - 1)
+#define P5K_HANDLE_GEN_MASK (0xffff)
+#define P5K_HANDLE_CHUNK (256)
+#define P5K_HANDLE_CHUNKS ((1u << P5K_HANDLE_INDEX_BITS) / P5K_HANDLE_CHUNK)
+
+#define P5K_HANDLE_NONE ((p5k_handle)0)
+
+p5k_slot *p5k_handles_slot(p5k_handles *handles, u32 index) {
+  return &handles->chunks[index / P5K_HANDLE_CHUNK][index % P5K_HANDLE_CHUNK];
+}
+
+bool p5k_handles_grow(p5k_handles *handles) {
+  if (handles->len >= (1u << P5K_HANDLE_INDEX_BITS))
+    return false;
+
+  if (!handles->chunks) {
+    handles->chunks = p5k_kcalloc(P5K_HANDLE_CHUNKS, sizeof(p5k_slot *));
+    if (!handles->chunks)
+      return false;
+  }
+
+  p5k_slot *chunk = p5k_kcalloc(P5K_HANDLE_CHUNK, sizeof(p5k_slot));
+  if (!chunk)
+    return false;
+
+  let len = atomic_load_explicit(&handles->len, memory_order_relaxed);
+
+  /* Free slots start out with generation 0, the free list holds indices
+   * plus one. */
+  for (u32 i = P5K_HANDLE_CHUNK; i-- > 0;) {
+    chunk[i].next = handles->free;
+    handles->free = len + i + 1;
+  }
+
+  handles->chunks[len / P5K_HANDLE_CHUNK] = chunk;
+  atomic_store_explicit(&handles->len, len + P5K_HANDLE_CHUNK,
+                        memory_order_release);
+  return true;
+}
+
+/* Installs obj in the table, the table takes over the caller's reference. */
+p5k_handle p5k_handle_alloc(p5k_space *space, p5k_object *obj) {
+  var handles = &space->handles;
+
+  p5k_lock_acquire(&handles->lock);
+
+  if (!handles->free && !p5k_handles_grow(handles)) {
+    p5k_lock_release(&handles->lock);
+    return P5K_HANDLE_NONE;
+  }
+
+  let index = handles->free - 1;
+  var slot = p5k_handles_slot(handles, index);
+  handles->free = slot->next;
+  slot->obj = obj;
+  slot->gen = (slot->gen + 1) & P5K_HANDLE_GEN_MASK;
+  let gen = slot->gen;
+
+  p5k_lock_release(&handles->lock);
+  return (gen << P5K_HANDLE_INDEX_BITS) | index;
+}
+
+/* Callers hold the table lock. */
+p5k_slot *p5k_handles_find(p5k_handles *handles, p5k_handle handle) {
+  let index = handle & P5K_HANDLE_INDEX_MASK;
+  let gen = handle >> P5K_HANDLE_INDEX_BITS;
+
+  if (index >= handles->len || !(gen & 1))
+    return nil;
+
+  var slot = p5k_handles_slot(handles, index);
+  return slot->gen == gen ? slot : nil;
+}
+
+/* Resolves a handle to a new reference on its object, taken under the lock
+ * so a close on another hart cannot free the object in between. */
+p5k_object *p5k_handle_get(p5k_space *space, p5k_handle handle) {
+  var handles = &space->handles;
+
+  p5k_lock_acquire(&handles->lock);
+  var slot = p5k_handles_find(handles, handle);
+  var obj = slot ? p5k_ref(slot->obj) : nil;
+  p5k_lock_release(&handles->lock);
+
+  return obj;
+}
+
+bool p5k_handle_close(p5k_space *space, p5k_handle handle) {
+  var handles = &space->handles;
+
+  p5k_lock_acquire(&handles->lock);
+
+  var slot = p5k_handles_find(handles, handle);
+  if (!slot) {
+    p5k_lock_release(&handles->lock);
+    return false;
+  }
+
+  p5k_object *obj = slot->obj;
+  slot->gen = (slot->gen + 1) & P5K_HANDLE_GEN_MASK;
+  slot->next = handles->free;
+  handles->free = (handle & P5K_HANDLE_INDEX_MASK) + 1;
+
+  p5k_lock_release(&handles->lock);
+
+  p5k_deref(obj);
+  return true;
+}
+
+void p5k_handles_fini(p5k_handles *handles) {
+  if (!handles->chunks)
+    return;
+
+  for (u32 c = 0; c < handles->len / P5K_HANDLE_CHUNK; c++) {
+    for (u32 i = 0; i < P5K_HANDLE_CHUNK; i++)
+      if (handles->chunks[c][i].gen & 1)
+        p5k_deref(handles->chunks[c][i].obj);
+    p5k_kfree(handles->chunks[c]);
+  }
+
+  p5k_kfree(handles->chunks);
+  *handles = (p5k_handles){};
+}
+
+/* --- Timers --------------------------------------------------------------- */
+
+/* Timers are one-shot: the hardware is only ever programmed for the earliest
+ * deadline in the wheel, so an idle hart sleeps until there is work. Every
+ * hart has its own wheel and comparator, a timer fires on the hart that set
+ * it and is only ever set or cancelled from there. */
+
+#define P5K_WHEEL_BITS (6)
+#define P5K_WHEEL_SLOTS (1 << P5K_WHEEL_BITS)
+#define P5K_WHEEL_MASK (P5K_WHEEL_SLOTS - 1)
+#define P5K_WHEEL_LEVELS (4)
+#define P5K_WHEEL_SPAN(level) ((u64)1 << (P5K_WHEEL_BITS * (level)))
+
+/* Roughly the number of wheel units per second, the unit is rounded down to a
+ * power of two timebase ticks so converting never needs a 64-bit divide. */
+#define P5K_TIMER_HZ (10000)
+
+#define P5K_TIME_NEVER ((u64)-1)
+
+typedef struct p5k_timer {
+  struct p5k_timer *next, **pprev;
+  u64 deadline;
+  u8 level, slot;
+  void (*fn)(struct p5k_timer *timer);
+} p5k_timer;
+
+typedef struct {
+  _Alignas(P5K_CACHE_LINE) u64 now;
+  u64 programmed;
+  u64 bitmap[P5K_WHEEL_LEVELS];
+  p5k_timer *slots[P5K_WHEEL_LEVELS][P5K_WHEEL_SLOTS];
+} p5k_wheel;
+
+static struct {
+  u32 freq, per_ms, shift;
+  bool sstc;
+} p5k_timers;
+
+static p5k_wheel p5k_wheels[P5K_HART_MAX];
+
+p5k_wheel *p5k_wheel_self(void) { return &p5k_wheels[p5k_hart_self()]; }
+
+u64 p5k_time(void) { return riscv_time(); }
+
+u64 p5k_time_ms(u64 ms) { return ms * p5k_timers.per_ms; }
+
+/* Deadlines round up to whole units so timers never fire early. */
+u64 p5k_wheel_unit(u64 deadline) {
+  let mask = ((u64)1 << p5k_timers.shift) - 1;
+  return (deadline >> p5k_timers.shift) + ((deadline & mask) != 0);
+}
+
+void p5k_wheel_link(p5k_wheel *wheel, p5k_timer *timer, usize level,
+                    usize slot) {
+  var head = &wheel->slots[level][slot];
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->next = *head;
+  timer->pprev = head;
+  if (*head)
+    (*head)->pprev = &timer->next;
+  *head = timer;
+  wheel->bitmap[level] |= (u64)1 << slot;
+}
+
+void p5k_wheel_unlink(p5k_wheel *wheel, p5k_timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next)
+    timer->next->pprev = timer->pprev;
+  timer->pprev = nil;
+
+  if (!wheel->slots[timer->level][timer->slot])
+    wheel->bitmap[timer->level] &= ~((u64)1 << timer->slot);
+}
+
+/* Level n holds deadlines less than 64^(n+1) units away, in the slot of the
+ * unit's nth digit. Anything further out waits in the last slot of the top
+ * level and is re-inserted when that slot cascades. */
+void p5k_wheel_insert(p5k_wheel *wheel, p5k_timer *timer) {
+  var unit = p5k_wheel_unit(timer->deadline);
+  usize level = 0;
+
+  if (unit < wheel->now)
+    unit = wheel->now;
+  if (unit - wheel->now >= P5K_WHEEL_SPAN(P5K_WHEEL_LEVELS))
+    unit = wheel->now + P5K_WHEEL_SPAN(P5K_WHEEL_LEVELS) - 1;
+
+  while (unit - wheel->now >= P5K_WHEEL_SPAN(level + 1))
+    level++;
+
+  p5k_wheel_link(wheel, timer, level,
+                 (unit >> (P5K_WHEEL_BITS * level)) & P5K_WHEEL_MASK);
+}
+
+/* First unit that has something to run or cascade, found from the slot
+ * bitmaps without visiting the empty units in between. Slots behind the
+ * current digit belong to the next rotation, and so does the current one on
+ * an upper level once its boundary has been processed. */
+u64 p5k_wheel_next(p5k_wheel *wheel) {
+  u64 best = P5K_TIME_NEVER;
+
+  for (usize level = 0; level < P5K_WHEEL_LEVELS; level++) {
+    let bitmap = wheel->bitmap[level];
+    if (!bitmap)
+      continue;
+
+    let shift = P5K_WHEEL_BITS * level;
+    let cur = (wheel->now >> shift) & P5K_WHEEL_MASK;
+    let first = cur + ((wheel->now & (P5K_WHEEL_SPAN(level) - 1)) != 0);
+    var rotation = wheel->now >> (shift + P5K_WHEEL_BITS)
+                                     << (shift + P5K_WHEEL_BITS);
+    var ahead = first < P5K_WHEEL_SLOTS ? bitmap & ((u64)-1 << first) : 0;
+
+    if (!ahead) {
+      rotation += P5K_WHEEL_SPAN(level + 1);
+      ahead = bitmap;
+    }
+
+    let unit = rotation + ((u64)__builtin_ctzll(ahead) << shift);
+    best = unit < best ? unit : best;
+  }
+
+  return best;
+}
+
+void p5k_wheel_cascade(p5k_wheel *wheel, usize level) {
+  let slot = (wheel->now >> (P5K_WHEEL_BITS * level)) & P5K_WHEEL_MASK;
+  var timer = wheel->slots[level][slot];
+
+  wheel->slots[level][slot] = nil;
+  wheel->bitmap[level] &= ~((u64)1 << slot);
+
+  while (timer) {
+    var next = timer->next;
+    p5k_wheel_insert(wheel, timer);
+    timer = next;
+  }
+}
+
+/* Runs every timer due at or before target, skipping straight to the units
+ * that have work. Handlers may re-arm their own or any other timer. */
+void p5k_wheel_expire(p5k_wheel *wheel, u64 target) {
+  for (;;) {
+    let unit = p5k_wheel_next(wheel);
+    if (unit > target)
+      break;
+
+    wheel->now = unit;
+    for (usize level = P5K_WHEEL_LEVELS - 1; level > 0; level--)
+      if (!(unit & (P5K_WHEEL_SPAN(level) - 1)))
+        p5k_wheel_cascade(wheel, level);
+
+    let slot = unit & P5K_WHEEL_MASK;
+    p5k_timer *expired = wheel->slots[0][slot];
+    wheel->slots[0][slot] = nil;
+    wheel->bitmap[0] &= ~((u64)1 << slot);
+    if (expired)
+      expired->pprev = &expired;
+
+    wheel->now = unit + 1;
+    while (expired) {
+      var timer = expired;
+      p5k_wheel_unlink(wheel, timer);
+      timer->fn(timer);
+    }
+  }
+
+  if (target >= wheel->now)
+    wheel->now = target + 1;
+}
+
+void p5k_timer_program(p5k_wheel *wheel) {
+  let unit = p5k_wheel_next(wheel);
+  let deadline =
+      unit == P5K_TIME_NEVER ? P5K_TIME_NEVER : unit << p5k_timers.shift;
+
+  if (deadline == wheel->programmed)
+    return;
+
+  wheel->programmed = deadline;
+  if (p5k_timers.sstc)
+    riscv_stimecmp(deadline);
+  else
+    sbi_set_timer(deadline);
+}
+
+p5k_timer *p5k_timer_init(p5k_timer *timer, void (*fn)(p5k_timer *timer)) {
+  *timer = (p5k_timer){.fn = fn};
+  return timer;
+}
+
+bool p5k_timer_armed(p5k_timer *timer) { return timer->pprev != nil; }
+
+/* Arms the timer for an absolute deadline in timebase ticks, re-arming it if
+ * it was already pending. */
+void p5k_timer_set(p5k_timer *timer, u64 deadline) {
+  var wheel = p5k_wheel_self();
+
+  if (p5k_timer_armed(timer))
+    p5k_wheel_unlink(wheel, timer);
+
+  /* An empty wheel may not have been advanced in a long while. */
+  if (p5k_wheel_next(wheel) == P5K_TIME_NEVER) {
+    let now = p5k_time() >> p5k_timers.shift;
+    wheel->now = now > wheel->now ? now : wheel->now;
+  }
+
+  timer->deadline = deadline;
+  p5k_wheel_insert(wheel, timer);
+  p5k_timer_program(wheel);
+}
+
+void p5k_timer_cancel(p5k_timer *timer) {
+  if (!p5k_timer_armed(timer))
+    return;
+
+  var wheel = p5k_wheel_self();
+  p5k_wheel_unlink(wheel, timer);
+  p5k_timer_program(wheel);
+}
+
+bool p5k_timer_irq(p5k_frame *) {
+  var wheel = p5k_wheel_self();
+  p5k_wheel_expire(wheel, p5k_time() >> p5k_timers.shift);
+
+  /* The compare value has passed, it must be rewritten even if the next
+   * deadline happens to be the same. */
+  wheel->programmed = 0;
+  p5k_timer_program(wheel);
+  return false;
+}
+
+void p5k_timers_init(void) {
+  if (!p5k_harts.freq)
+    p5k_panic(_s("timer: no timebase-frequency"));
+
+  p5k_timers.sstc = p5k_hart_has(P5K_HART_SSTC);
+  if (!p5k_timers.sstc && !sbi_probe_extension(SBI_TIME_EXT_ID).value)
+    p5k_panic(_s("timer: neither sstc nor the sbi time extension"));
+
+  let per_unit = p5k_harts.freq / P5K_TIMER_HZ;
+  p5k_timers.freq = p5k_harts.freq;
+  p5k_timers.per_ms = p5k_harts.freq / 1000;
+  p5k_timers.shift = per_unit > 1 ? 31 - __builtin_clz(per_unit) : 0;
+
+  p5k_trap_register(RISCV_CAUSE_INTERRUPT | RISCV_IRQ_S_TIMER, p5k_timer_irq);
+  p5k_log(_s("timer: %d Hz, %d ticks per unit, %s"), p5k_timers.freq,
+          1 << p5k_timers.shift, p5k_timers.sstc ? "sstc" : "sbi");
+}
+
+/* Nothing is pending yet, the comparator is parked. */
+void p5k_timers_init_hart(void) {
+  var wheel = p5k_wheel_self();
+
+  wheel->now = p5k_time() >> p5k_timers.shift;
+  wheel->programmed = 0;
+  p5k_timer_program(wheel);
+  riscv_csrs(sie, RISCV_SIE_STIE);
+}
+
+/* The kernel runs with interrupts masked everywhere but here. With nothing
+ * due the comparator is parked and wfi sleeps until a real event. */
+void p5k_idle(void) {
+  riscv_ei();
+  for (;;)
+    riscv_wfi();
+}
+
+/* --- Scheduler ------------------------------------------------------------ */
+
+/* Every hart owns a run queue of intrusive FIFOs, one per priority, with a
+ * bitmap of the non-empty ones so picking the highest is a count of leading
+ * zeros. Tasks with a deadline form an EDF class above all priorities, kept
+ * in a pairing heap ordered by deadline. Wakes from other harts go through
+ * a lock-free inbox the owner drains, idle harts steal from the others but
+ * only ever try their lock. A hart that queues work behind a running task
+ * kicks one idle hart to come and steal it. Nothing here touches the heap. */
+
+#define P5K_PRIO_LEVELS (32)
+#define P5K_PRIO_DEFAULT (16)
+
+#define P5K_SLICE_MS (10)
+#define P5K_KSTACK_ORDER (1)
+
+typedef struct {
+  _Alignas(P5K_CACHE_LINE) p5k_lock lock;
+  u32 bitmap;
+  p5k_fifo fifos[P5K_PRIO_LEVELS];
+  p5k_task *edf;
+  _Atomic usize waiting;
+
+  _Alignas(P5K_CACHE_LINE) p5k_task *_Atomic inbox;
+
+  /* Owner only from here on. */
+  _Alignas(P5K_CACHE_LINE) p5k_task *current;
+  p5k_task *handoff;
+  p5k_frame *idle;
+  p5k_timer slice;
+  bool preempt;
+} p5k_runq;
+
+static p5k_runq p5k_runqs[P5K_HART_MAX];
+
+/* Harts in the idle loop that nobody has kicked yet. */
+static _Atomic u32 p5k_sched_idle;
+
+p5k_runq *p5k_runq_self(void) { return &p5k_runqs[p5k_hart_self()]; }
+
+/* Whether a should run before b, EDF tasks go first. */
+bool p5k_task_before(p5k_task *a, p5k_task *b) {
+  if (a->deadline || b->deadline)
+    return a->deadline && (!b->deadline || a->deadline < b->deadline);
+  return a->prio > b->prio;
+}
+
+p5k_task *p5k_edf_meld(p5k_task *a, p5k_task *b) {
+  if (!a || !b)
+    return a ? a : b;
+
+  if (b->deadline < a->deadline) {
+    var t = a;
+    a = b;
+    b = t;
+  }
+
+  b->link = a->child;
+  a->child = b;
+  return a;
+}
+
+/* Removes the root, its children are melded in pairs left to right and the
+ * pairs back right to left. */
+p5k_task *p5k_edf_pop(p5k_task **heap) {
+  var root = *heap;
+  var child = root->child;
+  p5k_task *pairs = nil;
+
+  while (child) {
+    var a = child;
+    var b = child->link;
+    child = b ? b->link : nil;
+
+    a->link = nil;
+    if (b)
+      b->link = nil;
+
+    var pair = p5k_edf_meld(a, b);
+    pair->link = pairs;
+    pairs = pair;
+  }
+
+  p5k_task *rest = nil;
+  while (pairs) {
+    var next = pairs->link;
+    pairs->link = nil;
+    rest = p5k_edf_meld(pairs, rest);
+    pairs = next;
+  }
+
+  *heap = rest;
+  root->child = root->link = nil;
+  return root;
+}
+
+/* Callers hold the run queue lock. */
+void p5k_runq_push(p5k_runq *rq, p5k_task *task) {
+  task->link = task->child = nil;
+
+  if (task->deadline) {
+    rq->edf = p5k_edf_meld(rq->edf, task);
+  } else {
+    var fifo = &rq->fifos[task->prio];
+    if (fifo->tail)
+      fifo->tail->link = task;
+    else
+      fifo->head = task;
+    fifo->tail = task;
+    rq->bitmap |= (u32)1 << task->prio;
+  }
+
+  atomic_fetch_add_explicit(&rq->waiting, 1, memory_order_relaxed);
+}
+
+p5k_task *p5k_runq_pop(p5k_runq *rq) {
+  p5k_task *task;
+
+  if (rq->edf) {
+    task = p5k_edf_pop(&rq->edf);
+  } else if (rq->bitmap) {
+    let prio = 31 - __builtin_clz(rq->bitmap);
+    var fifo = &rq->fifos[prio];
+
+    task = fifo->head;
+    fifo->head = task->link;
+    if (!fifo->head) {
+      fifo->tail = nil;
+      rq->bitmap &= ~((u32)1 << prio);
+    }
+    task->link = nil;
+  } else {
+    return nil;
+  }
+
+  atomic_fetch_sub_explicit(&rq->waiting, 1, memory_order_relaxed);
+  return task;
+}
+
+/* The task the queue would hand out next, without removing it. */
+p5k_task *p5k_runq_peek(p5k_runq *rq) {
+  if (rq->edf)
+    return rq->edf;
+  if (rq->bitmap)
+    return rq->fifos[31 - __builtin_clz(rq->bitmap)].head;
+  return nil;
+}
+
+bool p5k_runq_waiting(p5k_runq *rq) {
+  return atomic_load_explicit(&rq->waiting, memory_order_relaxed) != 0;
+}
+
+/* The inbox is pushed to LIFO, reversed here to keep wake order. Returns
+ * whether anything came in that should run before the current task. */
+bool p5k_runq_drain(p5k_runq *rq) {
+  var list = atomic_exchange_explicit(&rq->inbox, nil, memory_order_acquire);
+  p5k_task *fifo = nil;
+  bool preempt = false;
+
+  if (!list)
+    return false;
+
+  while (list) {
+    var next = list->link;
+    list->link = fifo;
+    fifo = list;
+    list = next;
+  }
+
+  p5k_lock_acquire(&rq->lock);
+  while (fifo) {
+    var next = fifo->link;
+    preempt |= rq->current && p5k_task_before(fifo, rq->current);
+    p5k_runq_push(rq, fifo);
+    fifo = next;
+  }
+  p5k_lock_release(&rq->lock);
+
+  return preempt;
+}
+
+/* Requests a pass through the scheduler on a hart, an IPI raises the same
+ * interrupt remotely. */
+void p5k_sched_kick(usize hart) {
+  if (hart == p5k_hart_self())
+    riscv_csrs(sip, RISCV_SIP_SSIP);
+  else
+    p5k_harts_ipi((u32)1 << hart);
+}
+
+void p5k_sched_preempt(void) {
+  p5k_runq_self()->preempt = true;
+  riscv_csrs(sip, RISCV_SIP_SSIP);
+}
+
+void p5k_sched_slice_expired(p5k_timer *) { p5k_sched_preempt(); }
+
+/* Kicks one idle hart to come and steal, each is kicked once and marks itself
+ * again if it finds nothing. The fence pairs with the one in
+ * p5k_sched_switch: either the idle hart sees the queued task or the task's
+ * hart sees the idle mark. */
+void p5k_sched_kick_idle(void) {
+  atomic_thread_fence(memory_order_seq_cst);
+  var idle = atomic_load_explicit(&p5k_sched_idle, memory_order_relaxed);
+
+  while (idle) {
+    let hart = (usize)__builtin_ctz(idle);
+    if (atomic_compare_exchange_weak_explicit(
+            &p5k_sched_idle, &idle, idle & ~((u32)1 << hart),
+            memory_order_relaxed, memory_order_relaxed)) {
+      p5k_sched_kick(hart);
+      return;
+    }
+  }
+}
+
+/* The slice timer only runs while somebody is waiting for the hart, an idle
+ * hart may take that somebody sooner. */
+void p5k_sched_slice(p5k_runq *rq) {
+  if (rq->current && p5k_runq_waiting(rq)) {
+    if (!p5k_timer_armed(&rq->slice))
+      p5k_timer_set(&rq->slice, p5k_time() + p5k_time_ms(P5K_SLICE_MS));
+    p5k_sched_kick_idle();
+  } else {
+    p5k_timer_cancel(&rq->slice);
+  }
+}
+
+/* Makes a blocked task runnable on the hart it last ran on, preempting the
+ * current task there if it should run first. */
+void p5k_task_wake(p5k_task *task) {
+  u32 state = P5K_TASK_BLOCKED;
+  if (!atomic_compare_exchange_strong_explicit(&task->state, &state,
+                                               P5K_TASK_READY,
+                                               memory_order_acq_rel,
+                                               memory_order_relaxed))
+    return;
+
+  let hart = task->hart;
+  var rq = &p5k_runqs[hart];
+
+  if (hart != p5k_hart_self()) {
+    var head = atomic_load_explicit(&rq->inbox, memory_order_relaxed);
+    do
+      task->link = head;
+    while (!atomic_compare_exchange_weak_explicit(&rq->inbox, &head, task,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+    p5k_sched_kick(hart);
+    return;
+  }
+
+  p5k_lock_acquire(&rq->lock);
+  p5k_runq_push(rq, task);
+  p5k_lock_release(&rq->lock);
+
+  if (!rq->current)
+    p5k_sched_kick(hart);
+  else if (p5k_task_before(task, rq->current))
+    p5k_sched_preempt();
+  else
+    p5k_sched_slice(rq);
+}
+
+/* Marks the current task blocked, it leaves the hart on the way out of the
+ * trap and only comes back through p5k_task_wake. */
+void p5k_sched_block(void) {
+  var task = p5k_runq_self()->current;
+  atomic_store_explicit(&task->state, P5K_TASK_BLOCKED, memory_order_release);
+  p5k_sched_preempt();
+}
+
+/* Both only change while the task is off every run queue. */
+void p5k_task_set_prio(p5k_task *task, usize prio) {
+  task->prio = prio < P5K_PRIO_LEVELS ? prio : P5K_PRIO_LEVELS - 1;
+}
+
+/* An absolute deadline in timebase ticks moves the task into the EDF class,
+ * 0 moves it back to its priority. */
+void p5k_task_set_deadline(p5k_task *task, u64 deadline) {
+  task->deadline = deadline;
+}
+
+/* Local work first, then the best task of whichever other hart's queue can
+ * be locked without waiting. */
+p5k_task *p5k_sched_pick(p5k_runq *rq) {
+  p5k_runq_drain(rq);
+
+  p5k_lock_acquire(&rq->lock);
+  var task = p5k_runq_pop(rq);
+  p5k_lock_release(&rq->lock);
+
+  let self = p5k_hart_self();
+  for (usize i = 1; i < p5k_harts.count && !task; i++) {
+    var victim = &p5k_runqs[(self + i) % p5k_harts.count];
+    if (!p5k_runq_waiting(victim) || !p5k_lock_try(&victim->lock))
+      continue;
+
+    task = p5k_runq_pop(victim);
+    p5k_lock_release(&victim->lock);
+    if (task)
+      p5k_hart_cpu()->steals++;
+  }
+
+  return task;
+}
+
+/* Switches the hart away from the trapped context, returns the frame to
+ * resume: a task's or the idle loop's. */
+p5k_frame *p5k_sched_switch(p5k_frame *frame) {
+  var rq = p5k_runq_self();
+  var prev = rq->current;
+  let self = (u32)1 << p5k_hart_self();
+
+  rq->preempt = false;
+
+  if (prev) {
+    prev->frame = frame;
+    p5k_ext_leave(&prev->ext, frame);
+
+    u32 state = P5K_TASK_RUNNING;
+    if (atomic_compare_exchange_strong_explicit(&prev->state, &state,
+                                                P5K_TASK_READY,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+      p5k_lock_acquire(&rq->lock);
+      p5k_runq_push(rq, prev);
+      p5k_lock_release(&rq->lock);
+    }
+
+    /* Its frame is saved, a waker on another hart may pick it up now. */
+    atomic_store_explicit(&prev->on_hart, false, memory_order_release);
+  } else {
+    rq->idle = frame;
+  }
+
+  /* A handoff goes straight to its task, the queues are left alone. */
+  var next = rq->handoff ? rq->handoff : p5k_sched_pick(rq);
+  rq->handoff = nil;
+
+  /* Marked idle before looking once more, a task queued elsewhere meanwhile
+   * is either found here or its hart sees the mark and kicks this one. */
+  if (!next) {
+    atomic_fetch_or_explicit(&p5k_sched_idle, self, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    next = p5k_sched_pick(rq);
+  }
+  if (next && (atomic_load_explicit(&p5k_sched_idle, memory_order_relaxed) &
+               self))
+    atomic_fetch_and_explicit(&p5k_sched_idle, ~self, memory_order_relaxed);
+
+  rq->current = next;
+  p5k_sched_slice(rq);
+
+  if (!next)
+    return rq->idle;
+
+  while (atomic_load_explicit(&next->on_hart, memory_order_acquire))
+    ;
+  atomic_store_explicit(&next->on_hart, true, memory_order_relaxed);
+  atomic_store_explicit(&next->state, P5K_TASK_RUNNING, memory_order_relaxed);
+  next->hart = p5k_hart_self();
+  if (next != prev)
+    p5k_hart_cpu()->switches++;
+
+  p5k_space_activate(&next->space->space);
+  p5k_ext_enter(&next->ext, next->frame);
+  return next->frame;
+}
+
+/* Supervisor software interrupts are kicks: wakes into an idle hart, slice
+ * expiry, remote wakes and requests to steal. An idle hart always takes the
+ * full path, its own queue may be empty while another's is not. */
+bool p5k_sched_irq(p5k_frame *) {
+  var rq = p5k_runq_self();
+
+  riscv_csrc(sip, RISCV_SIP_SSIP);
+  if (p5k_runq_drain(rq))
+    rq->preempt = true;
+
+  if (rq->preempt || !rq->current)
+    return true;
+
+  p5k_sched_slice(rq);
+  return false;
+}
+
+/* Sets up a task to enter user mode at entry with the given stack, it starts
+ * out blocked until woken. The frame lives at the top of its kernel stack,
+ * where the trap path finds it through sscratch. */
+p5k_task *p5k_task_init(p5k_task *task, p5k_object *space, usize entry,
+                        usize sp) {
+  u8 *stack = p5k_pmm_alloc(P5K_KSTACK_ORDER);
+  if (!stack)
+    return nil;
+
+  task->stack = stack;
+  task->frame = (p5k_frame *)(stack + P5K_PMM_BLOCK(P5K_KSTACK_ORDER) -
+                              P5K_FRAME_SIZE);
+  *task->frame = (p5k_frame){
+      .sp = sp,
+      .sepc = entry,
+      .sstatus = RISCV_SSTATUS_SPIE,
+  };
+
+  task->space = p5k_ref(space);
+  task->hart = p5k_hart_self();
+  task->prio = P5K_PRIO_DEFAULT;
+  atomic_init(&task->state, P5K_TASK_BLOCKED);
+  atomic_init(&task->on_hart, false);
+  return task;
+}
+
+/* The task must be off every queue, i.e. blocked and never woken again. A
+ * caller still waiting for its reply gets an error instead. */
+void p5k_channel_cancel(p5k_task *task);
+
+void p5k_task_fini(p5k_task *task) {
+  p5k_channel_cancel(task);
+  if (task->reply) {
+    task->reply->frame->a0 = P5K_ERR_CLOSED;
+    p5k_task_wake(task->reply);
+  }
+
+  p5k_ext_fini(&task->ext);
+  if (task->space)
+    p5k_deref(task->space);
+  if (task->stack)
+    p5k_pmm_free(task->stack, P5K_KSTACK_ORDER);
+}
+
+void p5k_sched_init(void) {
+  for (usize i = 0; i < p5k_harts.count; i++)
+    p5k_timer_init(&p5k_runqs[i].slice, p5k_sched_slice_expired);
+
+  p5k_trap_register(RISCV_CAUSE_INTERRUPT | RISCV_IRQ_S_SOFT, p5k_sched_irq);
+}
+
+void p5k_sched_init_hart(void) { riscv_csrs(sie, RISCV_SIE_SSIE); }
+
+/* --- IPC ------------------------------------------------------------------ */
+
+/* Synchronous call and reply over endpoints. A call blocks the caller until
+ * the receiver replies, both ways the message is the words in a1-a5 and goes
+ * straight from one task's frame to the other's. When the other side is
+ * already waiting, the hart hands itself over to it directly without a trip
+ * through the run queues, the way the L4 fastpaths do.
+ *
+ * A blocked task's frame is written by whoever takes it off an endpoint,
+ * possibly while its own hart is still switching away from it. That is safe
+ * since the message registers were saved on entry and are not touched again
+ * on the way out. */
+
+#define P5K_IPC_WORDS (5)
+
+void p5k_fifo_push(p5k_fifo *fifo, p5k_task *task) {
+  task->link = nil;
+  if (fifo->tail)
+    fifo->tail->link = task;
+  else
+    fifo->head = task;
+  fifo->tail = task;
+}
+
+p5k_task *p5k_fifo_pop(p5k_fifo *fifo) {
+  var task = fifo->head;
+  if (!task)
+    return nil;
+
+  fifo->head = task->link;
+  if (!fifo->head)
+    fifo->tail = nil;
+  task->link = nil;
+  return task;
+}
+
+void p5k_ipc_copy(p5k_frame *dst, p5k_frame const *src) {
+  _Static_assert(P5K_IPC_WORDS == 5, "p5k_ipc_copy moves a1-a5");
+
+  dst->a0 = P5K_OK;
+  dst->a1 = src->a1;
+  dst->a2 = src->a2;
+  dst->a3 = src->a3;
+  dst->a4 = src->a4;
+  dst->a5 = src->a5;
+}
+
+/* Tasks go blocked before they are queued, so a waker on another hart never
+ * finds one still running. */
+void p5k_ipc_wait(p5k_task *task, p5k_fifo *fifo) {
+  atomic_store_explicit(&task->state, P5K_TASK_BLOCKED, memory_order_relaxed);
+  p5k_fifo_push(fifo, task);
+}
+
+/* Fast handlers for the calls below return true to leave the hart, with
+ * handoff set to switch to that task directly. */
+bool p5k_ipc_call(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                  p5k_object *obj) {
+  var ep = &obj->endpoint;
+
+  p5k_lock_acquire(&ep->lock);
+  var receiver = p5k_fifo_pop(&ep->receivers);
+  if (!receiver) {
+    p5k_ipc_wait(self, &ep->senders);
+    p5k_lock_release(&ep->lock);
+    return true;
+  }
+  atomic_store_explicit(&self->state, P5K_TASK_BLOCKED, memory_order_relaxed);
+  p5k_lock_release(&ep->lock);
+
+  p5k_ipc_copy(receiver->frame, frame);
+  receiver->reply = self;
+  rq->handoff = receiver;
+  return true;
+}
+
+/* Takes a waiting sender if there is one and stays on the hart, otherwise
+ * blocks on the endpoint after handing the hart to next. */
+bool p5k_ipc_receive(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                     p5k_endpoint *ep, p5k_task *next) {
+  p5k_lock_acquire(&ep->lock);
+  var sender = p5k_fifo_pop(&ep->senders);
+  if (!sender) {
+    p5k_ipc_wait(self, &ep->receivers);
+    p5k_lock_release(&ep->lock);
+    rq->handoff = next;
+    return true;
+  }
+  p5k_lock_release(&ep->lock);
+
+  p5k_ipc_copy(frame, sender->frame);
+  self->reply = sender;
+  if (next)
+    p5k_task_wake(next);
+  return false;
+}
+
+/* A task owing a reply has to send it first, taking another call would
+ * leave the earlier caller blocked for good. */
+bool p5k_ipc_recv(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                  p5k_object *obj) {
+  if (self->reply) {
+    frame->a0 = P5K_ERR_INVALID;
+    return false;
+  }
+
+  return p5k_ipc_receive(rq, self, frame, &obj->endpoint, nil);
+}
+
+/* The server loop in one trap: the reply goes out and the next call comes
+ * in, the caller gets the hart if nobody else is calling. */
+bool p5k_ipc_reply_recv(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                        p5k_object *obj) {
+  var caller = self->reply;
+  self->reply = nil;
+  if (caller)
+    p5k_ipc_copy(caller->frame, frame);
+
+  return p5k_ipc_receive(rq, self, frame, &obj->endpoint, caller);
+}
+
+/* Whoever is still queued on a dying endpoint is woken with an error. The
+ * queues are emptied under the lock like every other access to them, the
+ * wakes happen after it is dropped. */
+void p5k_endpoint_fini(p5k_endpoint *ep) {
+  p5k_lock_acquire(&ep->lock);
+  p5k_fifo fifos[] = {ep->senders, ep->receivers};
+  ep->senders = ep->receivers = (p5k_fifo){};
+  p5k_lock_release(&ep->lock);
+
+  for (usize i = 0; i < 2; i++) {
+    for (p5k_task *task; (task = p5k_fifo_pop(&fifos[i]));) {
+      task->frame->a0 = P5K_ERR_CLOSED;
+      p5k_task_wake(task);
+    }
+  }
+}
+
+/* --- Channels ------------------------------------------------------------- */
+
+/* Bulk data moves through the rings in a channel's shared memory without
+ * the kernel, which only sleeps and wakes the tasks at either end. Every
+ * page is populated up front so both ends and the kernel always see the
+ * same frames. */
+
+_Static_assert(sizeof(p5k_rings) <= P5K_PAGE_SIZE, "rings fit their page");
+
+/* Sets up a channel with size bytes of data after the rings. */
+p5k_channel *p5k_channel_init(p5k_channel *ch, usize size) {
+  ch->vmo = p5k_create(P5K_TYPE_VMO);
+  if (!ch->vmo)
+    return nil;
+
+  var vmo = &ch->vmo->vmo;
+  bool ok = p5k_vmo_init(vmo, P5K_PAGE_SIZE + size);
+
+  for (usize i = 0; ok && i < vmo->size / P5K_PAGE_SIZE; i++) {
+    usize *slot = p5k_vmo_slot(vmo, i, true);
+    ok = slot && (*slot = p5k_frame_alloc(true));
+  }
+
+  if (!ok) {
+    ch->vmo = p5k_deref(ch->vmo);
+    return nil;
+  }
+
+  ch->rings = (p5k_rings *)*p5k_vmo_slot(vmo, 0, false);
+  return ch;
+}
+
+bool p5k_channel_map(p5k_space *space, usize va, p5k_channel *ch) {
+  var vmo = &ch->vmo->vmo;
+  return p5k_space_map_vmo(space, va, vmo, 0, vmo->size,
+                           P5K_PTE_R | P5K_PTE_W);
+}
+
+/* Mappings go with the VMO, sleepers are woken with an error. */
+void p5k_channel_fini(p5k_channel *ch) {
+  for (usize ring = 0; ring < 2; ring++) {
+    for (usize word = 0; word < 2; word++) {
+      var task = ch->waiters[ring][word];
+      if (!task)
+        continue;
+      task->sleeps_on = nil;
+      task->frame->a0 = P5K_ERR_CLOSED;
+      p5k_task_wake(task);
+    }
+  }
+
+  p5k_deref(ch->vmo);
+}
+
+/* Drops a task's place among a channel's waiters, for a task that goes away
+ * without being woken. */
+void p5k_channel_cancel(p5k_task *task) {
+  var obj = task->sleeps_on;
+  if (!obj)
+    return;
+
+  var ch = &obj->channel;
+  var waiter = &ch->waiters[task->sleep_ring][task->sleep_word];
+
+  p5k_lock_acquire(&ch->lock);
+  if (*waiter == task)
+    *waiter = nil;
+  task->sleeps_on = nil;
+  p5k_lock_release(&ch->lock);
+}
+
+/* The ring in a1 and its index in a2. */
+bool p5k_channel_args(p5k_frame *frame) {
+  if (frame->a1 < 2 && frame->a2 <= P5K_RING_TAIL)
+    return true;
+
+  frame->a0 = P5K_ERR_INVALID;
+  return false;
+}
+
+/* Sleeps until the index in a2 of ring a1 moves away from a3. The check
+ * happens under the lock a waker takes, so a move that races with it either
+ * shows up here or finds the task already asleep. */
+bool p5k_channel_wait(p5k_runq *, p5k_task *self, p5k_frame *frame,
+                      p5k_object *obj) {
+  var ch = &obj->channel;
+  if (!p5k_channel_args(frame))
+    return false;
+
+  var ring = &ch->rings->rings[frame->a1];
+  var waiter = &ch->waiters[frame->a1][frame->a2];
+
+  p5k_lock_acquire(&ch->lock);
+
+  if (atomic_load_explicit(p5k_ring_word(ring, frame->a2),
+                           memory_order_acquire) != frame->a3) {
+    atomic_store_explicit(p5k_ring_flag(ring, frame->a2), 0,
+                          memory_order_relaxed);
+    p5k_lock_release(&ch->lock);
+    frame->a0 = P5K_OK;
+    return false;
+  }
+
+  /* Only one task consumes or produces on a ring. */
+  if (*waiter) {
+    p5k_lock_release(&ch->lock);
+    frame->a0 = P5K_ERR_INVALID;
+    return false;
+  }
+
+  frame->a0 = P5K_OK;
+  atomic_store_explicit(&self->state, P5K_TASK_BLOCKED, memory_order_relaxed);
+  *waiter = self;
+  self->sleeps_on = obj;
+  self->sleep_ring = frame->a1;
+  self->sleep_word = frame->a2;
+  p5k_lock_release(&ch->lock);
+  return true;
+}
+
+/* Wakes the sleeper on the index in a2 of ring a1, if any. The flag is only
+ * cleared together with an actual wake, a wake arriving before the sleeper
+ * got to wait leaves it for the next one. */
+bool p5k_channel_wake(p5k_runq *, p5k_task *, p5k_frame *frame,
+                      p5k_object *obj) {
+  var ch = &obj->channel;
+  if (!p5k_channel_args(frame))
+    return false;
+
+  var ring = &ch->rings->rings[frame->a1];
+  var waiter = &ch->waiters[frame->a1][frame->a2];
+
+  p5k_lock_acquire(&ch->lock);
+  var task = *waiter;
+  if (task) {
+    *waiter = nil;
+    task->sleeps_on = nil;
+    atomic_store_explicit(p5k_ring_flag(ring, frame->a2), 0,
+                          memory_order_relaxed);
+  }
+  p5k_lock_release(&ch->lock);
+
+  frame->a0 = P5K_OK;
+  if (task)
+    p5k_task_wake(task);
+  return false;
+}
+
+/* --- System Calls --------------------------------------------------------- */
+
+/* The number goes in a7, the arguments and results in a0-a5. Must match
+ * kernel.s. */
+enum p5k_sys {
+  P5K_SYS_CALL = 1,
+  P5K_SYS_RECV = 2,
+  P5K_SYS_REPLY_RECV = 3,
+  P5K_SYS_EXIT = 4,
+  P5K_SYS_CHANNEL_WAIT = 5,
+  P5K_SYS_CHANNEL_WAKE = 6,
+};
+
+/* Takes the task off the hart for good, a caller still waiting for its
+ * reply gets P5K_ERR_CLOSED. */
+void p5k_task_exit(p5k_task *self) {
+  atomic_store_explicit(&self->state, P5K_TASK_EXITED, memory_order_relaxed);
+  p5k_channel_cancel(self);
+
+  if (self->reply) {
+    self->reply->frame->a0 = P5K_ERR_CLOSED;
+    p5k_task_wake(self->reply);
+    self->reply = nil;
+  }
+}
+
+bool p5k_sys_exit(p5k_task *self, p5k_frame *frame) {
+  p5k_log(_s("sys: task %x exited with %d"), self, frame->a0);
+  p5k_task_exit(self);
+  return true;
+}
+
+/* Fast handlers call this for a trap the task cannot recover from, it exits
+ * as if it had asked to and the full path switches away from it. */
+bool p5k_task_fault(void) {
+  var self = p5k_runq_self()->current;
+
+  p5k_log(_s("trap: task %x killed"), self);
+  p5k_task_exit(self);
+  return true;
+}
+
+typedef bool (*p5k_sys_fn)(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                           p5k_object *obj);
+
+/* Runs fn on the object behind the handle in a0, holding a reference for
+ * the length of the call in case another hart closes the handle. */
+bool p5k_sys_object(p5k_runq *rq, p5k_task *self, p5k_frame *frame,
+                    enum p5k_type type, p5k_sys_fn fn) {
+  var obj = p5k_handle_get(&self->space->space, frame->a0);
+  if (!obj || obj->type != type) {
+    if (obj)
+      p5k_deref(obj);
+    frame->a0 = P5K_ERR_HANDLE;
+    return false;
+  }
+
+  let leave = fn(rq, self, frame, obj);
+  p5k_deref(obj);
+  return leave;
+}
+
+/* Fast handler for ecalls from user mode. */
+bool p5k_syscall(p5k_frame *frame) {
+  var rq = p5k_runq_self();
+  var self = rq->current;
+
+  frame->sepc += 4;
+
+  switch (frame->a7) {
+  case P5K_SYS_CALL:
+    return p5k_sys_object(rq, self, frame, P5K_TYPE_ENDPOINT, p5k_ipc_call);
+  case P5K_SYS_RECV:
+    return p5k_sys_object(rq, self, frame, P5K_TYPE_ENDPOINT, p5k_ipc_recv);
+  case P5K_SYS_REPLY_RECV:
+    return p5k_sys_object(rq, self, frame, P5K_TYPE_ENDPOINT,
+                          p5k_ipc_reply_recv);
+  case P5K_SYS_EXIT:
+    return p5k_sys_exit(self, frame);
+  case P5K_SYS_CHANNEL_WAIT:
+    return p5k_sys_object(rq, self, frame, P5K_TYPE_CHANNEL,
+                          p5k_channel_wait);
+  case P5K_SYS_CHANNEL_WAKE:
+    return p5k_sys_object(rq, self, frame, P5K_TYPE_CHANNEL,
+                          p5k_channel_wake);
+  default:
+    frame->a0 = P5K_ERR_SYSCALL;
+    return false;
+  }
+}
+
+void p5k_syscall_init(void) {
+  p5k_trap_register(RISCV_EXC_ECALL_U, p5k_syscall);
+}
+
+/* The benches' user code lives in kernel.s, copied once into a page every
+ * bench task maps at P5K_BENCH_VA. */
+#define P5K_BENCH_VA (0x10000)
+
+extern u8 _p5k_bench_start[], _p5k_bench_end[];
+
+static p5k_object *p5k_bench_vmo;
+
+p5k_object *p5k_bench_code(void) {
+  if (p5k_bench_vmo)
+    return p5k_bench_vmo;
+
+  let size = (usize)(_p5k_bench_end - _p5k_bench_start);
+  var code = p5k_create(P5K_TYPE_VMO);
+
+  if (!code || !p5k_vmo_init(&code->vmo, P5K_PAGE_SIZE))
+    p5k_panic(_s("bench: out of memory for code"));
+
+  usize *slot = p5k_vmo_slot(&code->vmo, 0, true);
+  if (!slot || !(*slot = p5k_frame_alloc(true)))
+    p5k_panic(_s("bench: out of memory for code"));
+  mem_copy((bytes){size, (u8 *)*slot}, (bytes){size, _p5k_bench_start});
+
+  /* The code was written as data, every hart's fetches must see it. */
+  riscv_fence_i();
+  u32 harts = atomic_load_explicit(&p5k_harts.online, memory_order_relaxed) &
+              ~((u32)1 << p5k_hart_self());
+  while (harts) {
+    usize base;
+    let window = p5k_harts_window(&harts, &base);
+    sbi_remote_fence_i(window, base);
+  }
+
+  return p5k_bench_vmo = code;
+}
+
+/* A task in a space of its own running the bench code from entry, with a
+ * handle to obj in a0. */
+p5k_task *p5k_bench_task(p5k_object *obj, u8 *entry) {
+  var code = p5k_bench_code();
+  var space = p5k_create(P5K_TYPE_SPACE);
+  var task = p5k_create(P5K_TYPE_TASK);
+  let va = P5K_BENCH_VA + (usize)(entry - _p5k_bench_start);
+
+  if (!space || !task ||
+      !p5k_space_map_vmo(&space->space, P5K_BENCH_VA, &code->vmo, 0,
+                         P5K_PAGE_SIZE, P5K_PTE_R | P5K_PTE_X) ||
+      !p5k_task_init(&task->task, space, va, 0))
+    p5k_panic(_s("bench: out of memory for task"));
+
+  let handle = p5k_handle_alloc(&space->space, p5k_ref(obj));
+  if (handle == P5K_HANDLE_NONE)
+    p5k_panic(_s("bench: out of memory for handle"));
+
+  p5k_deref(space);
+  task->task.frame->a0 = handle;
+  return &task->task;
+}
+
+/* The client makes a call per round and exits with the cycles each took,
+ * the server replies to every call. The tasks are never reaped. */
+#define P5K_IPC_BENCH_SHIFT (10)
+
+extern u8 _p5k_ipc_bench_client[], _p5k_ipc_bench_server[];
+
+void p5k_ipc_bench(void) {
+  var ep = p5k_create(P5K_TYPE_ENDPOINT);
+  if (!ep)
+    p5k_panic(_s("ipc: out of memory for bench"));
+
+  var server = p5k_bench_task(ep, _p5k_ipc_bench_server);
+  var client = p5k_bench_task(ep, _p5k_ipc_bench_client);
+  client->frame->a1 = (usize)1 << P5K_IPC_BENCH_SHIFT;
+  client->frame->a2 = P5K_IPC_BENCH_SHIFT;
+
+  p5k_deref(ep);
+  p5k_log(_s("ipc: bench of %d calls, client %x reports cycles per call"),
+          (usize)1 << P5K_IPC_BENCH_SHIFT, client);
+  p5k_task_wake(server);
+  p5k_task_wake(client);
+}
+
+/* A producer and a consumer in separate spaces share a channel mapped at
+ * P5K_CHANNEL_BENCH_VA and pass descriptors over ring 0, sleeping through
+ * the channel calls whenever it runs full or empty. The producer exits with
+ * the cycles per message, the consumer with 0 unless a descriptor came out
+ * of order. */
+#define P5K_CHANNEL_BENCH_VA (0x20000)
+#define P5K_CHANNEL_BENCH_SHIFT (12)
+
+_Static_assert(offsetof(p5k_ring, head) == 0 &&
+                   offsetof(p5k_ring, producer_waiting) == 4 &&
+                   offsetof(p5k_ring, tail) == 64 &&
+                   offsetof(p5k_ring, consumer_waiting) == 68 &&
+                   offsetof(p5k_ring, descs) == 128 &&
+                   sizeof(p5k_desc) == 8 && P5K_RING_SLOTS == 128 &&
+                   P5K_RING_HEAD == 0 && P5K_RING_TAIL == 1,
+               "p5k_ring layout used by kernel.s");
+
+extern u8 _p5k_channel_bench_producer[], _p5k_channel_bench_consumer[];
+
+p5k_task *p5k_channel_bench_task(p5k_object *ch, u8 *entry) {
+  var task = p5k_bench_task(ch, entry);
+  if (!p5k_channel_map(&task->space->space, P5K_CHANNEL_BENCH_VA,
+                       &ch->channel))
+    p5k_panic(_s("channel: out of memory mapping bench channel"));
+
+  task->frame->a1 = P5K_CHANNEL_BENCH_VA;
+  task->frame->a2 = (usize)1 << P5K_CHANNEL_BENCH_SHIFT;
+  return task;
+}
+
+void p5k_channel_bench(void) {
+  var ch = p5k_create(P5K_TYPE_CHANNEL);
+  if (!ch || !p5k_channel_init(&ch->channel, P5K_PAGE_SIZE))
+    p5k_panic(_s("channel: out of memory for bench"));
+
+  var consumer = p5k_channel_bench_task(ch, _p5k_channel_bench_consumer);
+  var producer = p5k_channel_bench_task(ch, _p5k_channel_bench_producer);
+  producer->frame->a3 = P5K_CHANNEL_BENCH_SHIFT;
+
+  p5k_deref(ch);
+  p5k_log(_s("channel: bench of %d messages, producer %x reports cycles "
+             "per message"),
+          (usize)1 << P5K_CHANNEL_BENCH_SHIFT, producer);
+  p5k_task_wake(consumer);
+  p5k_task_wake(producer);
+}
+
+/* --- Kernel Entry Point --------------------------------------------------- */
+
+#define P5K_HART_STACK_ORDER (2)
+
+extern void _p5k_hart_entry(void);
+
+/* Per-hart CSR state, the same on every hart. */
+void p5k_hart_setup(void) {
+  atomic_fetch_or_explicit(&p5k_harts.online, (u32)1 << p5k_hart_self(),
+                           memory_order_relaxed);
+  riscv_csrw(sscratch, 0);
+  riscv_csrw(stvec, (usize)_p5k_trap);
+  /* User code may read the counters, the benches time themselves. */
+  riscv_csrw(scounteren,
+             RISCV_SCOUNTEREN_CY | RISCV_SCOUNTEREN_TM | RISCV_SCOUNTEREN_IR);
+  p5k_ext_init_hart();
+  p5k_timers_init_hart();
+  p5k_sched_init_hart();
+}
+
+/* Secondary harts come here from _p5k_hart_entry, on their own stack with tp
+ * already pointing at their block. */
+void p5k_hart_main(usize hartid, p5k_hart *hart) {
+  p5k_space_activate(&p5k_kernel_space);
+  riscv_sfence_vma();
+  p5k_hart_setup();
+  p5k_log(_s("harts: hart %d up as %d"), hartid, hart->index);
+
+  p5k_idle();
+
+  p5K_unreachable();
+}
+
+/* Starts every other hart, which from then on shares the kernel's global
+ * state. Everything they rely on must be set up by now. */
+void p5k_harts_start(void) {
+  if (p5k_harts.count > 1 && (!sbi_probe_extension(SBI_HSM_EXT_ID).value ||
+                               !sbi_probe_extension(SBI_IPI_EXT_ID).value ||
+                               !sbi_probe_extension(SBI_RFENCE_EXT_ID).value)) {
+    p5k_log(_s("harts: sbi lacks hsm, ipi or rfence, staying on one hart"));
+    p5k_harts.count = 1;
+  }
+
+  for (usize i = 1; i < p5k_harts.count; i++) {
+    var hart = &p5k_hart_blocks[i];
+    u8 *stack = p5k_pmm_alloc(P5K_HART_STACK_ORDER);
+    if (!stack)
+      p5k_panic(_s("harts: out of memory for hart stacks"));
+    hart->stack = (usize)stack + P5K_PMM_BLOCK(P5K_HART_STACK_ORDER);
+
+    let ret = sbi_hart_start(hart->hartid, (usize)_p5k_hart_entry,
+                             (usize)hart);
+    if (ret.error)
+      p5k_log(_s("harts: hart %d failed to start, error %d"), hart->hartid,
+              ret.error);
+  }
+}
+
+void p5k_entry(usize hart, usize dtb) {
+  mem_zero((bytes){__bss_end - __bss_start, __bss_start});
+  p5k_hart_bind(&p5k_hart_blocks[0]);
+  sbi_console_putchar('\n');
+  p5k_log(_s("p5k version 0.0.1"), hart, dtb);
+  p5k_log(_s("hart=%x, dtb=%x"), hart, dtb);
+  p5k_log(_s("kernel=%x-%x"), &__kernel_start, &__kernel_end);
+
+  struct fdt fdt;
+  if (fdt_open((void const *)dtb, &fdt).type != RES_OK)
+    p5k_panic(_s("invalid device tree at %x"), dtb);
+  p5k_harts_init(&fdt, hart);
+  p5k_pmm_init(&fdt);
+  p5k_heap_init();
+  p5k_space_init_kernel();
+
+  p5k_ext_init();
+  p5k_timers_init();
+  p5k_sched_init();
+  p5k_syscall_init();
+  p5k_hart_setup();
+  p5k_trap_bench();
+  p5k_harts_start();
+  p5k_ipc_bench();
+  p5k_channel_bench();
+
+  p5k_idle();
+
+  p5K_unreachable();
+}
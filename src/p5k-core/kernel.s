@@ -1,4 +1,4 @@
-.section .rodata
+.section .stack, "aw", @nobits
 __stack_top:
     .skip 0x20000
 __stack_bottom:
@@ -15,15 +15,52 @@ _kstart:
 
 
 .section .text
+
+/* p5k_frame is 33 words: ra gp tp t0-t6 a0-a7 s0-s11 sp sepc sstatus, padded
+ * so the stack stays 16 byte aligned. */
+.equ FRAME_SIZE, 4 * 36
+.equ FRAME_SP, 4 * 30
+.equ FRAME_SEPC, 4 * 31
+.equ FRAME_SSTATUS, 4 * 32
+.equ SSTATUS_SPP, 0x100
+
+/* The first words of p5k_hart, tp points at the hart's block in the kernel. */
+.equ HART_KSTACK, 4 * 0
+.equ HART_SCRATCH, 4 * 1
+.equ HART_STACK, 4 * 2
+
+/* Where sbi_hart_start drops the other harts, a0 holds the hartid and a1 the
+ * p5k_hart block with the stack allocated for it. */
+.global _p5k_hart_entry
+.type _p5k_hart_entry, @function
+_p5k_hart_entry:
+    mv ra, zero
+    mv fp, zero
+
+    mv tp, a1
+    lw sp, HART_STACK(tp)
+    jal p5k_hart_main
+
 .global _p5k_trap
 .type _p5k_trap, @function
 .align 4
+
+/* sscratch holds the hart's block while in user mode and 0 while in the
+ * kernel, where traps stay on the current stack. The block's kstack is the
+ * kernel stack top of the task in user mode, scratch holds the trapped sp
+ * until there is a frame for it. */
 _p5k_trap:
-    csrw sscratch, sp
-    addi sp, sp, -4 * 31
+    csrrw tp, sscratch, tp
+    bnez tp, 1f
+    csrr tp, sscratch
+    sw sp, HART_SCRATCH(tp)
+    j 2f
+1:
+    sw sp, HART_SCRATCH(tp)
+    lw sp, HART_KSTACK(tp)
+2:
+    addi sp, sp, -FRAME_SIZE
     sw ra,  4 * 0(sp)
-    sw gp,  4 * 1(sp)
-    sw tp,  4 * 2(sp)
     sw t0,  4 * 3(sp)
     sw t1,  4 * 4(sp)
     sw t2,  4 * 5(sp)
@@ -39,28 +76,54 @@ _p5k_trap:
     sw a5,  4 * 15(sp)
     sw a6,  4 * 16(sp)
     sw a7,  4 * 17(sp)
-    sw s0,  4 * 18(sp)
-    sw s1,  4 * 19(sp)
-    sw s2,  4 * 20(sp)
-    sw s3,  4 * 21(sp)
-    sw s4,  4 * 22(sp)
-    sw s5,  4 * 23(sp)
-    sw s6,  4 * 24(sp)
-    sw s7,  4 * 25(sp)
-    sw s8,  4 * 26(sp)
-    sw s9,  4 * 27(sp)
-    sw s10, 4 * 28(sp)
-    sw s11, 4 * 29(sp)
 
-    csrr a0, sscratch
-    sw a0, 4 * 30(sp)
+    csrrw t0, sscratch, zero
+    sw t0,  4 * 2(sp)
+    lw t0, HART_SCRATCH(tp)
+    sw t0, FRAME_SP(sp)
+    csrr t0, sepc
+    sw t0, FRAME_SEPC(sp)
 
+    /* Exceptions index the first 16 entries of p5k_trap_table, interrupts
+     * the next 16, causes without a handler take the full path. */
+    csrr t0, scause
+    li t1, 16
+    bgez t0, 2f
+    slli t0, t0, 1
+    srli t0, t0, 1
+    bgeu t0, t1, .Lslow
+    add t0, t0, t1
+    j 3f
+2:
+    bgeu t0, t1, .Lslow
+3:
+    la t1, p5k_trap_table
+    slli t0, t0, 2
+    add t1, t1, t0
+    lw t1, 0(t1)
+    beqz t1, .Lslow
+
+    /* Fast handlers only clobber caller-saved registers, a non-zero return
+     * asks for a full frame and a context switch. */
     mv a0, sp
-    call p5k_trap
+    jalr t1
+    bnez a0, .Lswitch
 
-    lw ra,  4 * 0(sp)
-    lw gp,  4 * 1(sp)
+/* Returns to user mode restore the task's tp and hand the block back to
+ * sscratch, the kernel keeps its own tp whatever the frame says. */
+.Lreturn:
+    lw t0, FRAME_SEPC(sp)
+    csrw sepc, t0
+
+    csrr t0, sstatus
+    andi t0, t0, SSTATUS_SPP
+    bnez t0, 4f
+    addi t0, sp, FRAME_SIZE
+    sw t0, HART_KSTACK(tp)
+    csrw sscratch, tp
     lw tp,  4 * 2(sp)
+4:
+    lw ra,  4 * 0(sp)
     lw t0,  4 * 3(sp)
     lw t1,  4 * 4(sp)
     lw t2,  4 * 5(sp)
@@ -76,6 +139,42 @@ _p5k_trap:
     lw a5,  4 * 15(sp)
     lw a6,  4 * 16(sp)
     lw a7,  4 * 17(sp)
+    lw sp,  FRAME_SP(sp)
+    sret
+
+.Lslow:
+    la t2, p5k_trap
+    j .Lfull
+
+.Lswitch:
+    la t2, p5k_trap_switch
+
+/* The full path also saves callee-saved registers and sstatus, the handler
+ * returns the frame to resume which may belong to another task. */
+.Lfull:
+    sw gp,  4 * 1(sp)
+    sw s0,  4 * 18(sp)
+    sw s1,  4 * 19(sp)
+    sw s2,  4 * 20(sp)
+    sw s3,  4 * 21(sp)
+    sw s4,  4 * 22(sp)
+    sw s5,  4 * 23(sp)
+    sw s6,  4 * 24(sp)
+    sw s7,  4 * 25(sp)
+    sw s8,  4 * 26(sp)
+    sw s9,  4 * 27(sp)
+    sw s10, 4 * 28(sp)
+    sw s11, 4 * 29(sp)
+    csrr t0, sstatus
+    sw t0, FRAME_SSTATUS(sp)
+
+    mv a0, sp
+    jalr t2
+    mv sp, a0
+
+    lw t0, FRAME_SSTATUS(sp)
+    csrw sstatus, t0
+    lw gp,  4 * 1(sp)
     lw s0,  4 * 18(sp)
     lw s1,  4 * 19(sp)
     lw s2,  4 * 20(sp)
@@ -88,5 +187,279 @@ _p5k_trap:
     lw s9,  4 * 27(sp)
     lw s10, 4 * 28(sp)
     lw s11, 4 * 29(sp)
-    lw sp,  4 * 30(sp)
-    sret
+    j .Lreturn
+
+/* User code of the benches, copied into one page by p5k_bench_code and
+ * position independent. */
+.equ SYS_CALL, 1
+.equ SYS_RECV, 2
+.equ SYS_REPLY_RECV, 3
+.equ SYS_EXIT, 4
+.equ SYS_CHANNEL_WAIT, 5
+.equ SYS_CHANNEL_WAKE, 6
+
+.global _p5k_bench_start
+.global _p5k_bench_end
+_p5k_bench_start:
+
+/* IPC bench: both start with the endpoint handle in a0, the client also
+ * with the number of calls in a1 and its log2 in a2. */
+.global _p5k_ipc_bench_client
+.global _p5k_ipc_bench_server
+_p5k_ipc_bench_client:
+    mv s0, a0
+    mv s1, a1
+    mv s3, a2
+    rdcycle s2
+1:
+    mv a0, s0
+    li a7, SYS_CALL
+    ecall
+    addi s1, s1, -1
+    bnez s1, 1b
+
+    rdcycle a0
+    sub a0, a0, s2
+    srl a0, a0, s3
+    li a7, SYS_EXIT
+    ecall
+    unimp
+
+_p5k_ipc_bench_server:
+    mv s0, a0
+    li a7, SYS_RECV
+    ecall
+1:
+    mv a0, s0
+    li a7, SYS_REPLY_RECV
+    ecall
+    j 1b
+
+/* Channel bench over ring 0, following p5k-ring/ring.h: the producer pushes
+ * descriptors numbered by their index, the consumer pops and checks them.
+ * Both start with the channel handle in a0, the rings' address in a1 and
+ * the number of messages in a2, the producer also with its log2 in a3. The
+ * producer exits with the cycles per message, the consumer with 0, or -1 on
+ * a descriptor out of order. Must match the ring layout checked by
+ * p5k_channel_bench. */
+.equ RING_HEAD, 0
+.equ RING_PRODUCER_WAITING, 4
+.equ RING_TAIL, 64
+.equ RING_CONSUMER_WAITING, 68
+.equ RING_DESCS, 128
+.equ RING_SLOTS, 128
+.equ RING_WORD_HEAD, 0
+.equ RING_WORD_TAIL, 1
+
+.global _p5k_channel_bench_producer
+.global _p5k_channel_bench_consumer
+_p5k_channel_bench_producer:
+    mv s0, a0
+    mv s1, a1
+    mv s2, a2
+    mv s3, a3
+    lw s4, RING_HEAD(s1)
+    li s6, RING_SLOTS
+    rdcycle s5
+1:
+    lw t0, RING_TAIL(s1)
+    fence r, rw
+    sub t1, s4, t0
+    bne t1, s6, 2f
+
+    /* Full: flag, look again, sleep while tail stays where it was. */
+    li t1, 1
+    sw t1, RING_PRODUCER_WAITING(s1)
+    fence rw, rw
+    lw t0, RING_TAIL(s1)
+    fence r, rw
+    sub t1, s4, t0
+    bne t1, s6, 3f
+
+    mv a0, s0
+    li a1, 0
+    li a2, RING_WORD_TAIL
+    mv a3, t0
+    li a7, SYS_CHANNEL_WAIT
+    ecall
+    bltz a0, 5f
+    j 1b
+3:
+    sw zero, RING_PRODUCER_WAITING(s1)
+2:
+    andi t1, s4, RING_SLOTS - 1
+    slli t1, t1, 3
+    add t1, t1, s1
+    sw s4, RING_DESCS(t1)
+    sw zero, RING_DESCS + 4(t1)
+    addi s4, s4, 1
+    fence rw, w
+    sw s4, RING_HEAD(s1)
+
+    fence rw, rw
+    lw t1, RING_CONSUMER_WAITING(s1)
+    beqz t1, 4f
+    mv a0, s0
+    li a1, 0
+    li a2, RING_WORD_HEAD
+    li a7, SYS_CHANNEL_WAKE
+    ecall
+4:
+    addi s2, s2, -1
+    bnez s2, 1b
+
+    rdcycle a0
+    sub a0, a0, s5
+    srl a0, a0, s3
+5:
+    li a7, SYS_EXIT
+    ecall
+    unimp
+
+_p5k_channel_bench_consumer:
+    mv s0, a0
+    mv s1, a1
+    mv s2, a2
+    lw s4, RING_TAIL(s1)
+1:
+    lw t0, RING_HEAD(s1)
+    fence r, rw
+    bne t0, s4, 2f
+
+    /* Empty: flag, look again, sleep while head stays where it was. */
+    li t1, 1
+    sw t1, RING_CONSUMER_WAITING(s1)
+    fence rw, rw
+    lw t0, RING_HEAD(s1)
+    fence r, rw
+    bne t0, s4, 3f
+
+    mv a0, s0
+    li a1, 0
+    li a2, RING_WORD_HEAD
+    mv a3, t0
+    li a7, SYS_CHANNEL_WAIT
+    ecall
+    bltz a0, 5f
+    j 1b
+3:
+    sw zero, RING_CONSUMER_WAITING(s1)
+2:
+    andi t1, s4, RING_SLOTS - 1
+    slli t1, t1, 3
+    add t1, t1, s1
+    lw t2, RING_DESCS(t1)
+    li a0, -1
+    bne t2, s4, 5f
+    addi s4, s4, 1
+    fence rw, w
+    sw s4, RING_TAIL(s1)
+
+    fence rw, rw
+    lw t1, RING_PRODUCER_WAITING(s1)
+    beqz t1, 4f
+    mv a0, s0
+    li a1, 0
+    li a2, RING_WORD_TAIL
+    li a7, SYS_CHANNEL_WAKE
+    ecall
+4:
+    addi s2, s2, -1
+    bnez s2, 1b
+
+    li a0, 0
+5:
+    li a7, SYS_EXIT
+    ecall
+    unimp
+_p5k_bench_end:
+
+/* Extension state, only ever touched with sstatus.FS or VS switched on by
+ * the caller. p5k_fpu_state is f0-f31 as doubles followed by fcsr. */
+.global p5k_fpu_save
+.type p5k_fpu_save, @function
+p5k_fpu_save:
+.option push
+.option arch, +d
+.irp n, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    fsd f\n, 8 * \n(a0)
+.endr
+.irp n, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+    fsd f\n, 8 * \n(a0)
+.endr
+    frcsr t0
+    sw t0, 8 * 32(a0)
+.option pop
+    ret
+
+.global p5k_fpu_load
+.type p5k_fpu_load, @function
+p5k_fpu_load:
+.option push
+.option arch, +d
+.irp n, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+    fld f\n, 8 * \n(a0)
+.endr
+.irp n, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+    fld f\n, 8 * \n(a0)
+.endr
+    lw t0, 8 * 32(a0)
+    fscsr t0
+.option pop
+    ret
+
+/* p5k_vec_state is vstart, vl, vtype and vcsr followed by v0-v31, each
+ * vlenb bytes. Whole register moves ignore vl, which is restored last
+ * together with vtype. */
+.global p5k_vec_save
+.type p5k_vec_save, @function
+p5k_vec_save:
+.option push
+.option arch, +v
+    csrr t0, vstart
+    sw t0, 4 * 0(a0)
+    csrr t0, vl
+    sw t0, 4 * 1(a0)
+    csrr t0, vtype
+    sw t0, 4 * 2(a0)
+    csrr t0, vcsr
+    sw t0, 4 * 3(a0)
+
+    csrr t1, vlenb
+    slli t1, t1, 3
+    addi a0, a0, 4 * 4
+    vs8r.v v0, (a0)
+    add a0, a0, t1
+    vs8r.v v8, (a0)
+    add a0, a0, t1
+    vs8r.v v16, (a0)
+    add a0, a0, t1
+    vs8r.v v24, (a0)
+.option pop
+    ret
+
+.global p5k_vec_load
+.type p5k_vec_load, @function
+p5k_vec_load:
+.option push
+.option arch, +v
+    csrr t1, vlenb
+    slli t1, t1, 3
+    addi t2, a0, 4 * 4
+    vl8re8.v v0, (t2)
+    add t2, t2, t1
+    vl8re8.v v8, (t2)
+    add t2, t2, t1
+    vl8re8.v v16, (t2)
+    add t2, t2, t1
+    vl8re8.v v24, (t2)
+
+    lw t0, 4 * 1(a0)
+    lw t1, 4 * 2(a0)
+    vsetvl zero, t0, t1
+    lw t0, 4 * 0(a0)
+    csrw vstart, t0
+    lw t0, 4 * 3(a0)
+    csrw vcsr, t0
+.option pop
+    ret
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <p5k-base/base.h>
+
+/* Layout of a channel's shared memory, the same for the kernel and the tasks
+ * at either end. The first page holds one single-producer single-consumer
+ * ring per direction, the data pages follow and descriptors point into
+ * them, so payloads are never copied.
+ *
+ * Indices run freely and wrap, a ring is empty when head == tail and full
+ * when they are P5K_RING_SLOTS apart. The producer owns head, the consumer
+ * owns tail, each on its own cache line.
+ *
+ * Sleeping goes through the kernel: the side about to wait sets its flag,
+ * checks the ring once more and passes the index it saw to the wait call,
+ * which only blocks while the index is unchanged. The other side checks the
+ * flag after moving its index and only then enters the kernel to wake it. */
+
+#define P5K_RING_SLOTS (128)
+#define P5K_RING_ALIGN (64)
+
+typedef struct {
+  u32 offset, len;
+} p5k_desc;
+
+typedef struct {
+  _Alignas(P5K_RING_ALIGN) _Atomic u32 head;
+  _Atomic u32 producer_waiting;
+
+  _Alignas(P5K_RING_ALIGN) _Atomic u32 tail;
+  _Atomic u32 consumer_waiting;
+
+  _Alignas(P5K_RING_ALIGN) p5k_desc descs[P5K_RING_SLOTS];
+} p5k_ring;
+
+typedef struct {
+  p5k_ring rings[2];
+} p5k_rings;
+
+/* The index a sleeper waits on: the consumer waits for head to move, the
+ * producer for tail. */
+enum p5k_ring_word {
+  P5K_RING_HEAD,
+  P5K_RING_TAIL,
+};
+
+_Atomic u32 *p5k_ring_word(p5k_ring *ring, enum p5k_ring_word word) {
+  return word == P5K_RING_HEAD ? &ring->head : &ring->tail;
+}
+
+_Atomic u32 *p5k_ring_flag(p5k_ring *ring, enum p5k_ring_word word) {
+  return word == P5K_RING_HEAD ? &ring->consumer_waiting
+                               : &ring->producer_waiting;
+}
+
+bool p5k_ring_push(p5k_ring *ring, p5k_desc desc) {
+  let head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  let tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (head - tail == P5K_RING_SLOTS)
+    return false;
+
+  ring->descs[head % P5K_RING_SLOTS] = desc;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+bool p5k_ring_pop(p5k_ring *ring, p5k_desc *desc) {
+  let tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  let head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  if (head == tail)
+    return false;
+
+  *desc = ring->descs[tail % P5K_RING_SLOTS];
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+/* Called before sleeping on word, returns whether the ring is still empty
+ * (or full) and the caller should wait with seen. The flag stays set until
+ * the kernel clears it. */
+bool p5k_ring_prepare(p5k_ring *ring, enum p5k_ring_word word, u32 *seen) {
+  var flag = p5k_ring_flag(ring, word);
+
+  atomic_store_explicit(flag, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  *seen = atomic_load_explicit(p5k_ring_word(ring, word), memory_order_acquire);
+
+  /* The caller owns the other index, it cannot move meanwhile. */
+  let own = atomic_load_explicit(word == P5K_RING_HEAD ? &ring->tail
+                                                       : &ring->head,
+                                 memory_order_relaxed);
+  if (word == P5K_RING_HEAD ? *seen == own : own - *seen == P5K_RING_SLOTS)
+    return true;
+
+  atomic_store_explicit(flag, 0, memory_order_relaxed);
+  return false;
+}
+
+/* Called after a push (HEAD) or a pop (TAIL), returns whether the other side
+ * is asleep on word and needs a wake through the kernel. */
+bool p5k_ring_notify(p5k_ring *ring, enum p5k_ring_word word) {
+  atomic_thread_fence(memory_order_seq_cst);
+  return atomic_load_explicit(p5k_ring_flag(ring, word),
+                              memory_order_relaxed) != 0;
+}
@@ -2,6 +2,41 @@
 
 #include <p5k-base/base.h>
 
+#define RISCV_CAUSE_INTERRUPT ((usize)1 << (sizeof(usize) * 8 - 1))
+
+#define RISCV_EXC_ILLEGAL_INST (2)
+#define RISCV_EXC_BREAKPOINT (3)
+#define RISCV_EXC_ECALL_U (8)
+#define RISCV_EXC_INST_PAGE_FAULT (12)
+#define RISCV_EXC_LOAD_PAGE_FAULT (13)
+#define RISCV_EXC_STORE_PAGE_FAULT (15)
+
+#define RISCV_IRQ_S_SOFT (1)
+#define RISCV_IRQ_S_TIMER (5)
+
+#define RISCV_SSTATUS_SIE ((usize)1 << 1)
+#define RISCV_SSTATUS_SPIE ((usize)1 << 5)
+#define RISCV_SSTATUS_SPP ((usize)1 << 8)
+#define RISCV_SSTATUS_SUM ((usize)1 << 18)
+
+/* Extension state fields, FS for F/D and VS for V. */
+#define RISCV_SSTATUS_VS_SHIFT (9)
+#define RISCV_SSTATUS_FS_SHIFT (13)
+
+enum riscv_xs {
+  RISCV_XS_OFF = 0,
+  RISCV_XS_INITIAL = 1,
+  RISCV_XS_CLEAN = 2,
+  RISCV_XS_DIRTY = 3,
+};
+#define RISCV_SIE_SSIE ((usize)1 << RISCV_IRQ_S_SOFT)
+#define RISCV_SIE_STIE ((usize)1 << RISCV_IRQ_S_TIMER)
+#define RISCV_SIP_SSIP RISCV_SIE_SSIE
+
+#define RISCV_SCOUNTEREN_CY ((usize)1 << 0)
+#define RISCV_SCOUNTEREN_TM ((usize)1 << 1)
+#define RISCV_SCOUNTEREN_IR ((usize)1 << 2)
+
 #define riscv_csrr(reg)                                                        \
   ({                                                                           \
     usize __tmp;                                                               \
@@ -15,10 +50,67 @@
     __asm__ __volatile__("csrw " #reg ", %0" ::"r"(__tmp));                    \
   })
 
+#define riscv_csrs(reg, bits)                                                  \
+  ({                                                                           \
+    usize __tmp = (bits);                                                      \
+    __asm__ __volatile__("csrs " #reg ", %0" ::"r"(__tmp));                    \
+  })
+
+#define riscv_csrc(reg, bits)                                                  \
+  ({                                                                           \
+    usize __tmp = (bits);                                                      \
+    __asm__ __volatile__("csrc " #reg ", %0" ::"r"(__tmp));                    \
+  })
+
 void riscv_unimp() { __asm__ __volatile__("unimp"); }
 
 void riscv_wfi() { __asm__ __volatile__("wfi"); }
 
-void riscv_di() { __asm__ __volatile__("csrci mstatus, 8"); }
+/* The kernel runs in S-mode, mstatus is out of reach. */
+void riscv_di() { __asm__ __volatile__("csrci sstatus, 2" ::: "memory"); }
+
+void riscv_ei() { __asm__ __volatile__("csrsi sstatus, 2" ::: "memory"); }
+
+void riscv_fence_i() { __asm__ __volatile__("fence.i" ::: "memory"); }
+
+void riscv_sfence_vma() { __asm__ __volatile__("sfence.vma" ::: "memory"); }
+
+void riscv_sfence_vma_addr(usize addr) {
+  __asm__ __volatile__("sfence.vma %0" ::"r"(addr) : "memory");
+}
+
+void riscv_sfence_vma_asid(usize addr, usize asid) {
+  __asm__ __volatile__("sfence.vma %0, %1" ::"r"(addr), "r"(asid) : "memory");
+}
+
+/* Every non-global entry of one ASID, which needs rs1 to be x0. */
+void riscv_sfence_vma_asid_all(usize asid) {
+  __asm__ __volatile__("sfence.vma zero, %0" ::"r"(asid) : "memory");
+}
+
+u64 riscv_time(void) {
+  if (sizeof(usize) == 8)
+    return riscv_csrr(time);
+
+  usize hi, lo;
+  do {
+    hi = riscv_csrr(timeh);
+    lo = riscv_csrr(time);
+  } while (hi != riscv_csrr(timeh));
+
+  return ((u64)hi << 32) | lo;
+}
+
+/* Sstc, spelled by number since the assembler only knows the names with the
+ * extension enabled. On rv32 the low half is parked at its maximum so the
+ * comparison never matches halfway through the update. */
+void riscv_stimecmp(u64 value) {
+  if (sizeof(usize) == 8) {
+    riscv_csrw(0x14d, value);
+    return;
+  }
 
-void riscv_ei() { __asm__ __volatile__("csrsi mstatus, 8"); }
\ No newline at end of file
+  riscv_csrw(0x14d, (usize)-1);
+  riscv_csrw(0x15d, value >> 32);
+  riscv_csrw(0x14d, value);
+}
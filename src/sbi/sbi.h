@@ -113,6 +113,79 @@ io sbi_console_io(void) {
   };
 }
 
+/* --- Timer Extension ------------------------------------------------------ */
+
+#define SBI_TIME_EXT_ID (0x54494D45)
+
+/* On rv32 the value is split across a0 and a1, rv64 ignores a1. Also clears
+ * the pending timer interrupt. */
+sbiret sbi_set_timer(u64 stime_value) {
+  return sbi_call(SBI_TIME_EXT_ID, 0, (long)stime_value,
+                  (long)(stime_value >> 32));
+}
+
+/* --- IPI Extension -------------------------------------------------------- */
+
+#define SBI_IPI_EXT_ID (0x735049)
+
+/* Hart masks are bit i for hartid hart_mask_base + i, a base of -1 means
+ * every hart. The IPI arrives as a supervisor software interrupt. */
+sbiret sbi_send_ipi(unsigned long hart_mask, unsigned long hart_mask_base) {
+  return sbi_call(SBI_IPI_EXT_ID, 0, hart_mask, hart_mask_base);
+}
+
+/* --- RFENCE Extension ----------------------------------------------------- */
+
+#define SBI_RFENCE_EXT_ID (0x52464E43)
+
+sbiret sbi_remote_fence_i(unsigned long hart_mask,
+                          unsigned long hart_mask_base) {
+  return sbi_call(SBI_RFENCE_EXT_ID, 0, hart_mask, hart_mask_base);
+}
+
+/* A size of -1 flushes the whole address space. */
+sbiret sbi_remote_sfence_vma(unsigned long hart_mask,
+                             unsigned long hart_mask_base,
+                             unsigned long start_addr, unsigned long size) {
+  return sbi_call(SBI_RFENCE_EXT_ID, 1, hart_mask, hart_mask_base, start_addr,
+                  size);
+}
+
+sbiret sbi_remote_sfence_vma_asid(unsigned long hart_mask,
+                                  unsigned long hart_mask_base,
+                                  unsigned long start_addr, unsigned long size,
+                                  unsigned long asid) {
+  return sbi_call(SBI_RFENCE_EXT_ID, 2, hart_mask, hart_mask_base, start_addr,
+                  size, asid);
+}
+
+/* --- Hart State Management Extension -------------------------------------- */
+
+#define SBI_HSM_EXT_ID (0x48534D)
+
+enum sbi_hart_state {
+  SBI_HART_STARTED = 0,
+  SBI_HART_STOPPED = 1,
+  SBI_HART_START_PENDING = 2,
+  SBI_HART_STOP_PENDING = 3,
+  SBI_HART_SUSPENDED = 4,
+  SBI_HART_SUSPEND_PENDING = 5,
+  SBI_HART_RESUME_PENDING = 6,
+};
+
+/* The hart enters start_addr in S-mode with the MMU off, a0 holding its
+ * hartid and a1 opaque. */
+sbiret sbi_hart_start(unsigned long hartid, unsigned long start_addr,
+                      unsigned long opaque) {
+  return sbi_call(SBI_HSM_EXT_ID, 0, hartid, start_addr, opaque);
+}
+
+sbiret sbi_hart_stop(void) { return sbi_call(SBI_HSM_EXT_ID, 1); }
+
+sbiret sbi_hart_get_status(unsigned long hartid) {
+  return sbi_call(SBI_HSM_EXT_ID, 2, hartid);
+}
+
 /* --- System Reset Extension ----------------------------------------------- */
 
 #define SBI_SYSTEM_RESET_EXT_ID (0x53525354)